@@ -2,147 +2,572 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <array>
+#include <variant>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <climits>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <charconv>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 using namespace std;
 
-const int BOARD_WIDTH = 80;
-const int BOARD_HEIGHT = 25;
+const int DEFAULT_BOARD_WIDTH = 80;
+const int DEFAULT_BOARD_HEIGHT = 25;
+const int MAX_BOARD_SIDE = 50000;
+// Coordinates, sizes and offsets are limited to this magnitude so sums of two of them never overflow an int.
+const int MAX_COORDINATE = 1 << 29;
 
-string getColorName(char color) {
-    switch (color) {
-        case 'r': return "red";
-        case 'g': return "green";
-        case 'b': return "blue";
-        case 'y': return "yellow";
-        case 'w': return "white";
-        default: return "unknown";
+bool inCoordinateRange(int value) {
+    return value >= -MAX_COORDINATE && value <= MAX_COORDINATE;
+}
+
+// Where command feedback goes. `output` carries the answers to queries (list, shapes, select,
+// threads, stats) and `info` the confirmations of edits; batch mode keeps the answers on stdout,
+// discards `info` and sends `error` to stderr.
+struct Console {
+    ostream* output = &cout;
+    ostream* info = &cout;
+    ostream* error = &cout;
+};
+
+Console console;
+
+// Log-linear latency histogram: four buckets per power of two, so percentiles are within 25%.
+class LatencyHistogram {
+private:
+    static const int BUCKETS = 256;
+    uint64_t counts[BUCKETS] = {};
+    uint64_t samples = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < 4) return (int)ns;
+        int exponent = 63 - __builtin_clzll(ns);
+        return 4 + (exponent - 2) * 4 + (int)((ns >> (exponent - 2)) & 3);
+    }
+
+    static uint64_t bucketLimit(int bucket) {
+        if (bucket < 4) return bucket;
+        int exponent = (bucket - 4) / 4 + 2;
+        return ((uint64_t)(5 + (bucket - 4) % 4) << (exponent - 2)) - 1;
+    }
+
+public:
+    void add(uint64_t ns) {
+        counts[bucketOf(ns)]++;
+        samples++;
+        totalNs += ns;
+        maxNs = std::max(maxNs, ns);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            counts[bucket] += other.counts[bucket];
+        }
+        samples += other.samples;
+        totalNs += other.totalNs;
+        maxNs = std::max(maxNs, other.maxNs);
+    }
+
+    uint64_t count() const { return samples; }
+    uint64_t total() const { return totalNs; }
+    uint64_t max() const { return maxNs; }
+    double mean() const { return samples ? (double)totalNs / samples : 0; }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)ceil(p / 100 * samples);
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank && seen > 0) return std::min(bucketLimit(bucket), maxNs);
+        }
+        return maxNs;
+    }
+};
+
+// Process-wide instrumentation behind the `stats` command. Counters touched from
+// render threads are atomics fed from per-thread tallies once per band.
+struct Metrics {
+    map<string, LatencyHistogram> commands;
+    map<string, LatencyHistogram> phases;
+    atomic<uint64_t> pixelsRasterized{0};
+    atomic<uint64_t> shapesRasterized{0};
+    atomic<uint64_t> shapeDrawsCulled{0};
+    atomic<uint64_t> pixelsCulled{0};
+    uint64_t frames = 0;
+    uint64_t frameBytes = 0;
+    uint64_t framesDropped = 0;
+    uint64_t fileBytesWritten = 0;
+    uint64_t fileBytesRead = 0;
+    atomic<uint64_t> hitTests{0};
+    atomic<uint64_t> hitTestShapesScanned{0};
+    atomic<uint64_t> logRecords{0};
+    atomic<uint64_t> logSyncs{0};
+    atomic<uint64_t> logCompactions{0};
+
+    void reset() {
+        commands.clear();
+        phases.clear();
+        pixelsRasterized = 0;
+        shapesRasterized = 0;
+        shapeDrawsCulled = 0;
+        pixelsCulled = 0;
+        frames = frameBytes = framesDropped = fileBytesWritten = fileBytesRead = hitTests = hitTestShapesScanned = 0;
+        logRecords = logSyncs = logCompactions = 0;
+    }
+
+    void print(ostream& out) const {
+        out << left << setw(12) << "command" << right << setw(10) << "count" << setw(12) << "total ms"
+            << setw(12) << "mean us" << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "max us" << endl;
+        auto row = [&](const string& name, const LatencyHistogram& h) {
+            out << left << setw(12) << name << right << setw(10) << h.count() << fixed << setprecision(2)
+                << setw(12) << h.total() / 1e6 << setw(12) << h.mean() / 1e3 << setw(12) << h.percentile(50) / 1e3
+                << setw(12) << h.percentile(99) / 1e3 << setw(12) << h.max() / 1e3 << endl;
+        };
+        for (const auto& [name, histogram] : commands) row(name, histogram);
+        for (const auto& [name, histogram] : phases) row("[" + name + "]", histogram);
+        out << "pixels rasterized: " << pixelsRasterized << ", shapes rasterized: " << shapesRasterized << endl;
+        out << "pixels culled: " << pixelsCulled << ", shape draws culled: " << shapeDrawsCulled << endl;
+        out << "frames: " << frames << ", frame bytes: " << frameBytes << ", dropped: " << framesDropped << endl;
+        out << "file bytes written: " << fileBytesWritten << ", read: " << fileBytesRead << endl;
+        out << "hit tests: " << hitTests << ", shapes scanned: " << hitTestShapesScanned << endl;
+        out << "log records: " << logRecords << ", syncs: " << logSyncs << ", compactions: " << logCompactions << endl;
+    }
+
+    void writeJson(ostream& out) const {
+        auto histograms = [&](const map<string, LatencyHistogram>& group) {
+            bool first = true;
+            for (const auto& [name, h] : group) {
+                out << (first ? "" : ",") << "\n    \"" << name << "\": {\"count\": " << h.count()
+                    << ", \"total_ns\": " << h.total() << ", \"p50_ns\": " << h.percentile(50)
+                    << ", \"p90_ns\": " << h.percentile(90) << ", \"p99_ns\": " << h.percentile(99)
+                    << ", \"max_ns\": " << h.max() << "}";
+                first = false;
+            }
+        };
+        out << "{\n  \"commands\": {";
+        histograms(commands);
+        out << "\n  },\n  \"phases\": {";
+        histograms(phases);
+        out << "\n  },\n  \"counters\": {\"pixels_rasterized\": " << pixelsRasterized
+            << ", \"shapes_rasterized\": " << shapesRasterized << ", \"pixels_culled\": " << pixelsCulled
+            << ", \"shape_draws_culled\": " << shapeDrawsCulled << ", \"frames\": " << frames
+            << ", \"frame_bytes\": " << frameBytes << ", \"frames_dropped\": " << framesDropped << ", \"file_bytes_written\": " << fileBytesWritten
+            << ", \"file_bytes_read\": " << fileBytesRead << ", \"hit_tests\": " << hitTests
+            << ", \"hit_test_shapes_scanned\": " << hitTestShapesScanned << ", \"log_records\": " << logRecords
+            << ", \"log_syncs\": " << logSyncs << ", \"log_compactions\": " << logCompactions << "}\n}\n";
+    }
+};
+
+Metrics metrics;
+
+struct RasterTally {
+    uint64_t pixels = 0;
+    uint64_t shapes = 0;
+    uint64_t culledShapes = 0;
+    uint64_t culledPixels = 0;
+};
+
+thread_local RasterTally rasterTally;
+
+// Frame timings kept by whichever thread composes, and folded into the metrics by the input loop.
+struct FrameTally {
+    LatencyHistogram compose;
+    LatencyHistogram write;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+
+    void merge(const FrameTally& other) {
+        compose.merge(other.compose);
+        write.merge(other.write);
+        frames += other.frames;
+        bytes += other.bytes;
+    }
+
+    void drainInto(Metrics& target) {
+        if (compose.count() > 0) target.phases["compose"].merge(compose);
+        if (write.count() > 0) target.phases["write"].merge(write);
+        target.frames += frames;
+        target.frameBytes += bytes;
+        *this = FrameTally();
+    }
+};
+
+inline uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class ScopedTimer {
+private:
+    LatencyHistogram& histogram;
+    uint64_t start;
+
+public:
+    explicit ScopedTimer(LatencyHistogram& histogram) : histogram(histogram), start(nowNs()) {}
+    ~ScopedTimer() { histogram.add(nowNs() - start); }
+};
+
+bool parseShapeId(string_view text, int& id) {
+    static const char prefix[] = "Shape";
+    const size_t prefixLength = sizeof(prefix) - 1;
+    if (text.compare(0, prefixLength, prefix) != 0 || text.size() == prefixLength) {
+        return false;
+    }
+    const char* last = text.data() + text.size();
+    auto result = from_chars(text.data() + prefixLength, last, id);
+    return result.ec == errc() && result.ptr == last && id > 0;
+}
+
+// Numbers typed by users and clients go through here: junk, overflow or a value past
+// MAX_COORDINATE is rejected instead of throwing or wrapping.
+bool parseInt(string_view text, int& value) {
+    const char* last = text.data() + text.size();
+    auto result = from_chars(text.data(), last, value);
+    return !text.empty() && result.ec == errc() && result.ptr == last && inCoordinateRange(value);
+}
+
+template <typename... Ints>
+bool readInts(istream& in, Ints&... values) {
+    auto readOne = [&](int& value) {
+        string token;
+        return bool(in >> token) && parseInt(token, value);
+    };
+    return (readOne(values) && ...);
+}
+
+bool validBoardSize(int width, int height) {
+    return width > 0 && height > 0 && width <= MAX_BOARD_SIDE && height <= MAX_BOARD_SIDE;
+}
+
+bool parseBoardSize(const string& text, int& width, int& height) {
+    const char* first = text.data();
+    const char* last = first + text.size();
+    auto result = from_chars(first, last, width);
+    if (result.ec != errc() || result.ptr == last || *result.ptr != 'x') {
+        return false;
+    }
+    result = from_chars(result.ptr + 1, last, height);
+    return result.ec == errc() && result.ptr == last && validBoardSize(width, height);
+}
+
+// The one color table. Canvas cells hold an index into it; shapes, listings and saved
+// boards use its letters and names. Index 0 is the blank cell, and at most 16 entries fit a cell.
+// Exported images use xterm's default RGB for each escape, on white paper.
+struct PaletteColor {
+    char code;
+    const char* name;
+    string_view escape;
+    uint8_t red, green, blue;
+};
+
+constexpr PaletteColor PALETTE[] = {
+    {' ', "none", "\033[0m", 255, 255, 255},
+    {'r', "red", "\033[31m", 205, 0, 0},
+    {'g', "green", "\033[32m", 0, 205, 0},
+    {'b', "blue", "\033[34m", 0, 0, 238},
+    {'y', "yellow", "\033[33m", 205, 205, 0},
+    {'m', "magenta", "\033[35m", 205, 0, 205},
+    {'c', "cyan", "\033[36m", 0, 205, 205},
+    {'w', "white", "\033[37m", 229, 229, 229},
+};
+const uint8_t BLANK_CELL = 0;
+const size_t MAX_ESCAPE_LENGTH = 5;
+
+constexpr array<uint8_t, 256> makeColorIndices() {
+    array<uint8_t, 256> indices{};
+    for (uint8_t i = 1; i < size(PALETTE); ++i) {
+        indices[(unsigned char)PALETTE[i].code] = i;
     }
+    return indices;
 }
 
-string getColorCode(char color) {
-    switch (color) {
-        case 'r': return "\033[31m"; // Red
-        case 'g': return "\033[32m"; // Green
-        case 'b': return "\033[34m"; // Blue
-        case 'y': return "\033[33m"; // Yellow
-        case 'm': return "\033[35m"; // Magenta
-        case 'c': return "\033[36m"; // Cyan
-        default: return "\033[0m";   // Reset
+constexpr bool escapesFit() {
+    for (const PaletteColor& color : PALETTE) {
+        if (color.escape.size() > MAX_ESCAPE_LENGTH) return false;
     }
+    return true;
+}
+
+static_assert(size(PALETTE) <= 16, "palette indices must fit in a 4-bit cell");
+static_assert(escapesFit(), "compose reserves MAX_ESCAPE_LENGTH bytes per color switch");
+constexpr array<uint8_t, 256> COLOR_INDICES = makeColorIndices();
+
+// Returns the palette index for a color letter, or BLANK_CELL if it names no color.
+uint8_t colorIndex(char code) {
+    return COLOR_INDICES[(unsigned char)code];
+}
+
+bool isColor(string_view color) {
+    return !color.empty() && colorIndex(color[0]) != BLANK_CELL;
+}
+
+string getColorName(char color) {
+    uint8_t index = colorIndex(color);
+    return index != BLANK_CELL ? PALETTE[index].name : "unknown";
+}
+
+string_view getColorCode(uint8_t index) {
+    return PALETTE[index].escape;
 }
 
-string resetColor() {
+const char* resetColor() {
     return "\033[0m"; // Reset to default color
 }
 
-class Shape{
-protected:
-    string id;
-    char color;
-    bool fill;
+struct Rect {
+    int x0, y0, x1, y1;
 
-public:
-    Shape(string id, char color, bool fill) : id(id), color(color), fill(fill) {}
-    virtual ~Shape() {}
-    virtual void draw(vector<vector<char>>& grid) const = 0;
-    virtual string getDescription() const = 0;
-    string getId() const { return id; }
-    virtual bool containsPoint(int x, int y) const = 0;
-    virtual bool edit(const vector<int>& parames) = 0;
-    void paint(char newColor) { color = newColor; }
-    virtual bool move(int newX, int newY) = 0;
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+    bool contains(int x, int y) const { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+    bool intersects(const Rect& other) const {
+        return x0 < other.x1 && other.x0 < x1 && y0 < other.y1 && other.y0 < y1;
+    }
+    Rect intersect(const Rect& other) const {
+        return {max(x0, other.x0), max(y0, other.y0), min(x1, other.x1), min(y1, other.y1)};
+    }
+    Rect unite(const Rect& other) const {
+        if (empty()) return other;
+        if (other.empty()) return *this;
+        return {min(x0, other.x0), min(y0, other.y0), max(x1, other.x1), max(y1, other.y1)};
+    }
 };
 
-class Board{
+// Reads the corners of `select rect`; both corner cells are inside and either order works.
+bool parseRegion(istream& in, Rect& area) {
+    int x0, y0, x1, y1;
+    if (!readInts(in, x0, y0, x1, y1)) return false;
+    area = {min(x0, x1), min(y0, y1), max(x0, x1) + 1, max(y0, y1) + 1};
+    return true;
+}
+
+const int CANVAS_BAND_SHIFT = 6;
+
+// Packs two palette indices per byte, even columns in the low nibble. Every row starts on
+// a byte boundary so bands of rows can be painted from different threads. Rows are stored in
+// blocks of 1 << CANVAS_BAND_SHIFT; share() hands out the blocks instead of copying them, and
+// the first write to a shared block copies just that block.
+class Canvas {
 private:
-    vector<vector<char>> grid;
-    vector<shared_ptr<Shape>> shapes;
-    shared_ptr<Shape> selectedShape = nullptr;
+    using Block = vector<uint8_t>;
 
-public:
-    Board() : grid(BOARD_HEIGHT, vector<char>(BOARD_WIDTH, ' ')) {}
+    int width, height;
+    size_t stride;
+    vector<shared_ptr<Block>> blocks;
+    vector<uint8_t> owned;
 
-    vector<shared_ptr<Shape>>& getShapes() {
-        return shapes;
+    size_t blockSize(size_t block) const {
+        return min(size_t(1) << CANVAS_BAND_SHIFT, size_t(height) - (block << CANVAS_BAND_SHIFT)) * stride;
     }
 
-    void drawBoard() {
-        for (auto &row : grid) {
-            fill(row.begin(), row.end(), ' ');
-        }
+    size_t offset(int y) const { return size_t(y & ((1 << CANVAS_BAND_SHIFT) - 1)) * stride; }
 
-        for (const auto &shape : shapes) {
-            shape->draw(grid);
+public:
+    Canvas(int width, int height)
+        : width(width), height(height), stride((size_t(width) + 1) / 2),
+          owned(((size_t)height + (1 << CANVAS_BAND_SHIFT) - 1) >> CANVAS_BAND_SHIFT, 1) {
+        for (size_t block = 0; block < owned.size(); ++block) {
+            blocks.push_back(make_shared<Block>(blockSize(block), BLANK_CELL));
         }
+    }
 
-        cout << "+";
-        for (int i = 0; i < BOARD_WIDTH; ++i) {
-            cout << "-";
+    Canvas(const Canvas& other) : width(other.width), height(other.height), stride(other.stride), owned(other.owned.size(), 1) {
+        for (const shared_ptr<Block>& block : other.blocks) {
+            blocks.push_back(make_shared<Block>(*block));
         }
-        cout << "+" << endl;
+    }
 
-        for (int row = 0; row < BOARD_HEIGHT; ++row) {
-            cout << "|";
-            for (int col = 0; col < BOARD_WIDTH; ++col) {
-                if (grid[row][col] != ' ') {
-                    cout << getColorCode(grid[row][col]) << grid[row][col] << resetColor();
-                } else {
-                    cout << grid[row][col];
-                }
+    Canvas& operator=(const Canvas& other) {
+        if (this == &other) return *this;
+        if (width != other.width || height != other.height) {
+            *this = Canvas(other);
+            return *this;
+        }
+        for (size_t block = 0; block < blocks.size(); ++block) {
+            if (owned[block]) {
+                *blocks[block] = *other.blocks[block];
+            } else {
+                blocks[block] = make_shared<Block>(*other.blocks[block]);
+                owned[block] = 1;
             }
-            cout << "|" << endl;
         }
+        return *this;
+    }
 
-        cout << "+";
-        for (int i = 0; i < BOARD_WIDTH; ++i) {
-            cout << "-";
+    Canvas(Canvas&&) = default;
+    Canvas& operator=(Canvas&&) = default;
+
+    // A read-only copy in O(height) that keeps seeing these cells while this canvas changes.
+    // Not thread-safe against writes to this canvas; the copy itself may be read anywhere.
+    Canvas share() {
+        Canvas copy(0, 0);
+        copy.width = width;
+        copy.height = height;
+        copy.stride = stride;
+        copy.blocks = blocks;
+        copy.owned.assign(blocks.size(), 0);
+        fill_n(owned.begin(), owned.size(), 0);
+        return copy;
+    }
+
+    // Takes private copies of the shared blocks holding rows [y0, y1), so threads can then
+    // write those rows without racing on the copy.
+    void own(int y0, int y1) {
+        if (y0 >= y1) return;
+        for (size_t block = size_t(y0) >> CANVAS_BAND_SHIFT; block <= size_t(y1 - 1) >> CANVAS_BAND_SHIFT; ++block) {
+            if (!owned[block]) {
+                blocks[block] = make_shared<Block>(*blocks[block]);
+                owned[block] = 1;
+            }
         }
-        cout << "+" << endl;
     }
 
-    void addShape(shared_ptr<Shape> shape) {
-        shapes.push_back(shape);
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    Rect bounds() const { return {0, 0, width, height}; }
+
+    uint8_t* row(int y) {
+        size_t block = size_t(y) >> CANVAS_BAND_SHIFT;
+        if (!owned[block]) own(y, y + 1);
+        return blocks[block]->data() + offset(y);
     }
+    const uint8_t* row(int y) const { return blocks[size_t(y) >> CANVAS_BAND_SHIFT]->data() + offset(y); }
 
-    void selectByCoord(int x, int y) {
-        for (const auto& shape : shapes) {
-            if (shape->containsPoint(x, y)) {
-                selectedShape = shape;
-                cout << "Shape selected: " << selectedShape->getDescription() << endl;
-                return;
-            }
+    static uint8_t cellAt(const uint8_t* row, int x) {
+        return x & 1 ? row[x >> 1] >> 4 : row[x >> 1] & 0x0F;
+    }
+
+    void fillSpan(int y, int x0, int x1, uint8_t value) {
+        uint8_t* cells = row(y);
+        if (x0 & 1 && x0 < x1) {
+            cells[x0 >> 1] = (cells[x0 >> 1] & 0x0F) | value << 4;
+            x0++;
+        }
+        if (x1 & 1 && x0 < x1) {
+            cells[x1 >> 1] = (cells[x1 >> 1] & 0xF0) | value;
+            x1--;
+        }
+        if (x0 < x1) {
+            memset(cells + (x0 >> 1), value * 0x11, (x1 - x0) >> 1);
         }
-        cout << "No shape found." << endl;
     }
 
-    void selectById(const string& id) {
-        auto it = find_if(shapes.begin(), shapes.end(), [&](shared_ptr<Shape>shape) {
-            return shape->getId() == id;
-        });
+    // Copies cells [x0, x1) of row y from a canvas of the same size.
+    void copySpan(const Canvas& from, int y, int x0, int x1) {
+        uint8_t* cells = row(y);
+        const uint8_t* source = from.row(y);
+        if (x0 & 1 && x0 < x1) {
+            cells[x0 >> 1] = (cells[x0 >> 1] & 0x0F) | (source[x0 >> 1] & 0xF0);
+            x0++;
+        }
+        if (x1 & 1 && x0 < x1) {
+            cells[x1 >> 1] = (cells[x1 >> 1] & 0xF0) | (source[x1 >> 1] & 0x0F);
+            x1--;
+        }
+        if (x0 < x1) {
+            memcpy(cells + (x0 >> 1), source + (x0 >> 1), (x1 - x0) >> 1);
+        }
+    }
 
-        if (it != shapes.end()) {
-            selectedShape = *it;
-            cout << "Shape selected: " << selectedShape->getDescription() << endl;
+    void fill(const Rect& area, uint8_t value) {
+        for (int y = area.y0; y < area.y1; ++y) {
+            fillSpan(y, area.x0, area.x1, value);
         }
-        else {
-            cout << "Shape not found." << endl;
+    }
+};
+
+// Fixed-size record used by the binary board format.
+struct ShapeRecord {
+    int32_t id;
+    uint8_t kind;
+    char color;
+    uint8_t fill;
+    uint8_t reserved;
+    int32_t x, y, a, b;
+};
+
+// Up to two [x0, x1) runs where a horizontal line crosses a shape, left to right.
+using CrossSection = array<pair<double, double>, 2>;
+
+class Shape{
+protected:
+    char color;
+    bool fill;
+
+    // Fills [x0, x1) on row py, clipped to the given area.
+    template <typename Target>
+    void span(Target& canvas, const Rect& clip, int py, int x0, int x1) const {
+        if (py < clip.y0 || py >= clip.y1) return;
+        x0 = max(x0, clip.x0);
+        x1 = min(x1, clip.x1);
+        if (x0 < x1) {
+            canvas.fillSpan(py, x0, x1, colorIndex(color));
         }
     }
 
-    shared_ptr<Shape> getSelectedShape() const {
-        return selectedShape;
+    template <typename Target>
+    void drawBox(Target& canvas, const Rect& clip, int left, int top, int width, int height) const {
+        if (width <= 0 || height <= 0) return;
+
+        int right = left + width;
+        int bottom = top + height;
+        int first = max(top, clip.y0);
+        int last = min(bottom, clip.y1);
+        for (int row = first; row < last; ++row) {
+            if (fill || row == top || row == bottom - 1) {
+                span(canvas, clip, row, left, right);
+            } else {
+                span(canvas, clip, row, left, left + 1);
+                span(canvas, clip, row, right - 1, right);
+            }
+        }
     }
 
-    void removeSelectedShape() {
-        if (selectedShape) {
-            shapes.erase(remove_if(shapes.begin(), shapes.end(), [&](shared_ptr<Shape>shape) {
-                return shape == selectedShape;
-            }), shapes.end());
-            cout << selectedShape->getId() << " " << selectedShape->getDescription() << " removed" << endl;
-            selectedShape = nullptr;
-        } else {
-            cout << " No shape selected to remove." << endl;
+    // Runs covered by a box at height py, in board units; frames are one cell thick like drawBox.
+    int boxCrossSection(double py, CrossSection& runs, int left, int top, int width, int height) const {
+        if (width <= 0 || height <= 0 || py < top || py >= top + height) return 0;
+        if (fill || py < top + 1 || py >= top + height - 1) {
+            runs[0] = {left, left + width};
+            return 1;
         }
+        runs[0] = {left, left + 1};
+        runs[1] = {left + width - 1, left + width};
+        return 2;
     }
+
+public:
+    Shape(char color, bool fill) : color(color), fill(fill) {}
+    char getColor() const { return color; }
+    bool isFilled() const { return fill; }
+    void paint(char newColor) { color = newColor; }
 };
 
 class Triangle : public Shape{
@@ -150,90 +575,78 @@ private:
     int x, y, height;
 
 public:
-    Triangle(string id, char color, bool fill, int x, int y, int height) : Shape(id, color, fill), x(x), y(y), height(height) {}
+    Triangle(char color, bool fill, int x, int y, int height) : Shape(color, fill), x(x), y(y), height(height) {}
 
-    void draw(vector<vector<char>>& grid) const override {
-        string colorCode = getColorCode(color);
-        string reset = resetColor();
+    template <typename Target>
+    void draw(Target& canvas, const Rect& clip) const {
         if (height <= 0) return;
 
-        for (int i = 0; i < height; i++) {
-            int leftMost = x - i;
-            int rightMost = x + i;
-            int posY = y + i;
-
-            if (posY < BOARD_HEIGHT && posY >= 0) {
-                if (leftMost >= 0 && leftMost < BOARD_WIDTH) {
-                    grid[posY][leftMost] = color;
-                }
-                if (rightMost >= 0 && rightMost < BOARD_WIDTH && leftMost != rightMost) {
-                    grid[posY][rightMost] = color;
-                }
+        int first = max(0, clip.y0 - y);
+        int last = min(height, clip.y1 - y);
+        for (int i = first; i < last; i++) {
+            if (fill || i == height - 1) {
+                span(canvas, clip, y + i, x - i, x + i + 1);
+            } else {
+                span(canvas, clip, y + i, x - i, x - i + 1);
+                span(canvas, clip, y + i, x + i, x + i + 1);
             }
         }
+    }
 
-        for (int j = 0; j < 2 * height - 1; j++) {
-            int baseX = x - height + 1 + j;
-            int baseY = y + height - 1;
-            if (baseX >= 0 && baseX < BOARD_WIDTH && baseY >= 0 && baseY < BOARD_HEIGHT) {
-                grid[baseY][baseX] = color;
-            }
-        }
+    Rect getBounds() const {
+        if (height <= 0) return {x, y, x, y};
+        return {x - height + 1, y, x + height, y + height};
+    }
 
-        if (fill) {
-            for (int i = 1; i < height; i++) {
-                for (int j = -i + 1; j < i; j++) {
-                    int posX = x + j;
-                    int posY = y + i;
-                    if (posX >= 0 && posX < BOARD_WIDTH && posY >= 0 && posY < BOARD_HEIGHT) {
-                        grid[posY][posX] = color;
-                    }
-                }
-            }
-        }
-        for (int row = 0; row < BOARD_HEIGHT; ++row) {
-            cout << "|";
-            for (int col = 0; col < BOARD_WIDTH; ++col) {
-                if (grid[row][col] == color) {
-                    cout << colorCode << grid[row][col] << reset;
-                } else {
-                    cout << grid[row][col];
-                }
-            }
-            cout << "|" << endl;
-        }
+    string getDescription() const {
+        return "triangle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(height);
     }
 
-    string getDescription() const override {
-        return id + " triangle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(height);
+    ShapeRecord toRecord() const {
+        return {0, 0, color, fill, 0, x, y, height, 0};
     }
 
-    bool containsPoint(int px, int py) const override {
+    bool containsPoint(int px, int py) const {
         if (py < y || py >= y + height) return false;
         int dx = py - y;
         return px >= x - dx && px <= x + dx;
     }
 
-    bool edit(const vector<int>& params) override {
+    // The exact triangle the rows approximate: apex at the top of cell x, base as wide as the bounds.
+    int crossSection(double py, CrossSection& runs) const {
+        if (height <= 0 || py < y || py >= y + height) return 0;
+        double half = (py - y) * (height - 0.5) / height;
+        double left = x + 0.5 - half;
+        double right = x + 0.5 + half;
+        if (fill || py >= y + height - 1) {
+            runs[0] = {left, right};
+            return 1;
+        }
+        runs[0] = {left, min(left + 1, right)};
+        runs[1] = {max(right - 1, left), right};
+        return 2;
+    }
+
+    bool edit(const vector<int>& params, int boardWidth, int boardHeight, bool quiet = false) {
         if (params.size() != 1) {
-            cout << "error: invalid argument count" << endl;
+            if (!quiet) *console.error << "error: invalid argument count" << endl;
             return false;
         }
 
         int newHeight = params[0];
-        if (newHeight <= 0 || x - newHeight + 1 < 0 || x + newHeight - 1 >= BOARD_WIDTH || y + newHeight - 1 >= BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+        if (newHeight <= 0 || x - newHeight + 1 < 0 || x + newHeight - 1 >= boardWidth || y + newHeight - 1 >= boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
         height = newHeight;
-        cout << "size of triangle changed" << endl;
+        if (!quiet) *console.info << "size of triangle changed" << endl;
         return true;
     }
 
-    bool move(int newX, int newY) override {
-        if (newX - height + 1 < 0 || newX + height - 1 >= BOARD_WIDTH || newY + height - 1 >= BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+    bool move(int newX, int newY, int boardWidth, int boardHeight, bool quiet = false) {
+        if (newX - height + 1 < 0 || newX + height - 1 >= boardWidth || newY + height - 1 >= boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
@@ -247,104 +660,141 @@ class Circle : public Shape{
 private:
     int x, y, radius;
 
-public:
-    Circle(string id, char color, bool fill, int x, int y, int radius) : Shape(id, color, fill), x(x), y(y), radius(radius) {}
-
-    void draw(vector<vector<char>>& grid) const override {
-        string colorCode = getColorCode(color);
-        string reset = resetColor();
-
-        int x0 = x;
-        int y0 = y;
-
-        int x = radius;
-        int y = 0;
-        int decisionOver2 = 1 - x;
-
-        while (x >= y) {
-            if (x0 + x >= 0 && x0 + x < BOARD_WIDTH && y0 + y >= 0 && y0 + y < BOARD_HEIGHT)
-                grid[y0 + y][x0 + x] = color;
-            if (x0 + y >= 0 && x0 + y < BOARD_WIDTH && y0 + x >= 0 && y0 + x < BOARD_HEIGHT)
-                grid[y0 + x][x0 + y] = color;
-            if (x0 - y >= 0 && x0 - y < BOARD_WIDTH && y0 + x >= 0 && y0 + x < BOARD_HEIGHT)
-                grid[y0 + x][x0 - y] = color;
-            if (x0 - x >= 0 && x0 - x < BOARD_WIDTH && y0 + y >= 0 && y0 + y < BOARD_HEIGHT)
-                grid[y0 + y][x0 - x] = color;
-            if (x0 - x >= 0 && x0 - x < BOARD_WIDTH && y0 - y >= 0 && y0 - y < BOARD_HEIGHT)
-                grid[y0 - y][x0 - x] = color;
-            if (x0 - y >= 0 && x0 - y < BOARD_WIDTH && y0 - x >= 0 && y0 - x < BOARD_HEIGHT)
-                grid[y0 - x][x0 - y] = color;
-            if (x0 + y >= 0 && x0 + y < BOARD_WIDTH && y0 - x >= 0 && y0 - x < BOARD_HEIGHT)
-                grid[y0 - x][x0 + y] = color;
-            if (x0 + x >= 0 && x0 + x < BOARD_WIDTH && y0 - y >= 0 && y0 - y < BOARD_HEIGHT)
-                grid[y0 - y][x0 + x] = color;
-
-            y++;
+    // Squares are taken in long long: radius * radius overflows an int from 46341 on.
+    int discHalfWidth(int dy) const {
+        long long remaining = (long long)radius * radius - (long long)dy * dy;
+        long long half = (long long)sqrt((double)remaining);
+        while (half * half > remaining) half--;
+        while ((half + 1) * (half + 1) <= remaining) half++;
+        return (int)half;
+    }
+
+    // Widest outline cell the midpoint algorithm plots on each row offset lo..hi, indexed from lo.
+    vector<int> outlineReach(int lo, int hi) const {
+        vector<int> reach(hi - lo + 1, 0);
+        auto plot = [&](int row, int dx) {
+            if (row >= lo && row <= hi) reach[row - lo] = max(reach[row - lo], dx);
+        };
+        int dx = radius;
+        int dy = 0;
+        int decisionOver2 = 1 - dx;
+        while (dx >= dy) {
+            plot(dy, dx);
+            plot(dx, dy);
+            dy++;
             if (decisionOver2 <= 0) {
-                decisionOver2 += 2 * y + 1;
+                decisionOver2 += 2 * dy + 1;
             } else {
-                x--;
-                decisionOver2 += 2 * (y - x) + 1;
+                dx--;
+                decisionOver2 += 2 * (dy - dx) + 1;
             }
         }
+        return reach;
+    }
+
+public:
+    Circle(char color, bool fill, int x, int y, int radius) : Shape(color, fill), x(x), y(y), radius(radius) {}
+
+    template <typename Target>
+    void draw(Target& canvas, const Rect& clip) const {
+        if (radius < 0) return;
 
         if (fill) {
-            for (int fy = -radius; fy <= radius; fy++) {
-                for (int fx = -radius; fx <= radius; fx++) {
-                    if (fx * fx + fy * fy <= radius * radius) {
-                        int fillX = x0 + fx;
-                        int fillY = y0 + fy;
-                        if (fillX >= 0 && fillX < BOARD_WIDTH && fillY >= 0 && fillY < BOARD_HEIGHT){
-                            grid[fillY][fillX] = color;
-                        }
-                    }
-                }
+            // Each row of the disk is one span; the midpoint outline can reach one cell further.
+            int first = max(-radius, clip.y0 - y);
+            int last = min(radius, clip.y1 - 1 - y);
+            if (first > last) return;
+            int lo = first <= 0 && last >= 0 ? 0 : min(abs(first), abs(last));
+            int hi = max(abs(first), abs(last));
+            vector<int> outline = outlineReach(lo, hi);
+            for (int dy = first; dy <= last; dy++) {
+                int reach = max(discHalfWidth(dy), outline[abs(dy) - lo]);
+                span(canvas, clip, y + dy, x - reach, x + reach + 1);
             }
+            return;
         }
 
-        for (int row = 0; row < BOARD_HEIGHT; ++row) {
-            cout << "|";
-            for (int col = 0; col < BOARD_WIDTH; ++col) {
-                if (grid[row][col] == color) {
-                    cout << colorCode << grid[row][col] << reset;
-                } else {
-                    cout << grid[row][col];
-                }
+        int dx = radius;
+        int dy = 0;
+        int decisionOver2 = 1 - dx;
+
+        while (dx >= dy) {
+            span(canvas, clip, y + dy, x - dx, x - dx + 1);
+            span(canvas, clip, y + dy, x + dx, x + dx + 1);
+            span(canvas, clip, y - dy, x - dx, x - dx + 1);
+            span(canvas, clip, y - dy, x + dx, x + dx + 1);
+            span(canvas, clip, y + dx, x - dy, x - dy + 1);
+            span(canvas, clip, y + dx, x + dy, x + dy + 1);
+            span(canvas, clip, y - dx, x - dy, x - dy + 1);
+            span(canvas, clip, y - dx, x + dy, x + dy + 1);
+
+            dy++;
+            if (decisionOver2 <= 0) {
+                decisionOver2 += 2 * dy + 1;
+            } else {
+                dx--;
+                decisionOver2 += 2 * (dy - dx) + 1;
             }
-            cout << "|" << endl;
         }
     }
 
-    string getDescription() const override {
-        return id + " circle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(radius);
+    Rect getBounds() const {
+        return {x - radius, y - radius, x + radius + 1, y + radius + 1};
     }
 
-    bool containsPoint(int px, int py) const override {
-        int dx = px - x;
-        int dy = py - y;
-        return dx * dx + dy * dy <= radius * radius;
+    string getDescription() const {
+        return "circle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(radius);
     }
 
-    bool edit(const vector<int>& params) override {
+    ShapeRecord toRecord() const {
+        return {0, 0, color, fill, 0, x, y, radius, 0};
+    }
+
+    bool containsPoint(int px, int py) const {
+        long long dx = px - x;
+        long long dy = py - y;
+        return dx * dx + dy * dy <= (long long)radius * radius;
+    }
+
+    // A disk of radius + 0.5 around the center of cell (x, y); the outline is one cell wide.
+    int crossSection(double py, CrossSection& runs) const {
+        if (radius < 0) return 0;
+        double dy = abs(py - (y + 0.5));
+        double outer = radius + 0.5;
+        if (dy >= outer) return 0;
+        double half = sqrt(outer * outer - dy * dy);
+        double center = x + 0.5;
+        double inner = radius - 0.5;
+        if (fill || dy >= inner) {
+            runs[0] = {center - half, center + half};
+            return 1;
+        }
+        double hole = sqrt(inner * inner - dy * dy);
+        runs[0] = {center - half, center - hole};
+        runs[1] = {center + hole, center + half};
+        return 2;
+    }
+
+    bool edit(const vector<int>& params, int boardWidth, int boardHeight, bool quiet = false) {
         if (params.size() != 1) {
-            cout << "error: invalid arguments count" << endl;
+            if (!quiet) *console.error << "error: invalid arguments count" << endl;
             return false;
         }
 
         int newRadius = params[0];
-        if (newRadius <= 0 || x - newRadius < 0 || x + newRadius >= BOARD_WIDTH || y - newRadius < 0 || y + newRadius >= BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+        if (newRadius <= 0 || x - newRadius < 0 || x + newRadius >= boardWidth || y - newRadius < 0 || y + newRadius >= boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
         radius = newRadius;
-        cout << "size of circle changed" << endl;
+        if (!quiet) *console.info << "size of circle changed" << endl;
         return true;
     }
 
-    bool move(int newX, int newY) override {
-        if (newX - radius < 0 || newX + radius >= BOARD_WIDTH || newY - radius < 0 || newY + radius >= BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+    bool move(int newX, int newY, int boardWidth, int boardHeight, bool quiet = false) {
+        if (newX - radius < 0 || newX + radius >= boardWidth || newY - radius < 0 || newY + radius >= boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
@@ -359,97 +809,55 @@ private:
     int x, y, width, height;
 
 public:
-    Rectangle(string id, char color, bool fill, int x, int y, int width, int height) : Shape(id, color, fill), x(x), y(y), width(width), height(height) {}
-
-    void draw(vector<vector<char>>& grid) const override {
-        string colorCode = getColorCode(color);
-        string reset = resetColor();
+    Rectangle(char color, bool fill, int x, int y, int width, int height) : Shape(color, fill), x(x), y(y), width(width), height(height) {}
 
-        for (int i = 0; i < width; i++) {
-            int topX = x + i;
-            int topY = y;
-            int bottomY = y + height - 1;
-
-            if (topX >= 0 && topX < BOARD_WIDTH) {
-                if (topY >= 0 && topY < BOARD_HEIGHT) {
-                    grid[topY][topX] = color;
-                }
-                if (bottomY >= 0 && bottomY < BOARD_HEIGHT) {
-                    grid[bottomY][topX] = color;
-                }
-            }
-        }
-
-        for (int j = 0; j < height; j++) {
-            int leftX = x;
-            int rightX = x + width - 1;
-            int drawY = y + j;
-
-            if (drawY >= 0 && drawY < BOARD_HEIGHT) {
-                if (leftX >= 0 && leftX < BOARD_WIDTH) {
-                    grid[drawY][leftX] = color;
-                }
-                if (rightX >= 0 && rightX < BOARD_WIDTH) {
-                    grid[drawY][rightX] = color;
-                }
-            }
-        }
+    template <typename Target>
+    void draw(Target& canvas, const Rect& clip) const {
+        drawBox(canvas, clip, x, y, width, height);
+    }
 
-        if (fill) {
-            for (int i = 1; i < height - 1; i++) {
-                for (int j = 1; j < width - 1; j++) {
-                    int fillX = x + j;
-                    int fillY = y + i;
-                    if (fillX >= 0 && fillX < BOARD_WIDTH && fillY >= 0 && fillY < BOARD_HEIGHT) {
-                        grid[fillY][fillX] = color;
-                    }
-                }
-            }
-        }
+    Rect getBounds() const {
+        return {x, y, x + max(width, 0), y + max(height, 0)};
+    }
 
-        for (int row = 0; row < BOARD_HEIGHT; ++row) {
-            cout << "|";
-            for (int col = 0; col < BOARD_WIDTH; ++col) {
-                if (grid[row][col] == color) {
-                    cout << colorCode << grid[row][col] << reset;
-                } else {
-                    cout << grid[row][col];
-                }
-            }
-            cout << "|" << endl;
-        }
+    string getDescription() const {
+        return "rectangle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(width) + " " + to_string(height);
     }
 
-    string getDescription() const override {
-        return id + " rectangle " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(width) + " " + to_string(height);
+    ShapeRecord toRecord() const {
+        return {0, 0, color, fill, 0, x, y, width, height};
     }
 
-    bool containsPoint(int px, int py) const override {
+    bool containsPoint(int px, int py) const {
         return px >= x && px < x + width && py >= y && py < y + height;
     }
 
-    bool edit(const vector<int>& params) {
+    int crossSection(double py, CrossSection& runs) const {
+        return boxCrossSection(py, runs, x, y, width, height);
+    }
+
+    bool edit(const vector<int>& params, int boardWidth, int boardHeight, bool quiet = false) {
         if (params.size() != 2) {
-            cout << "error: invalid argument count" << endl;
+            if (!quiet) *console.error << "error: invalid argument count" << endl;
             return false;
         }
 
         int newWidth = params[0];
         int newHeight = params[1];
-        if (newWidth <= 0 || newHeight <= 0 || x + newWidth - 1 >= BOARD_WIDTH || y + newHeight - 1 >= BOARD_HEIGHT) {
-            cout << "error: shape will go out the board" << endl;
+        if (newWidth <= 0 || newHeight <= 0 || x + newWidth - 1 >= boardWidth || y + newHeight - 1 >= boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out the board" << endl;
             return false;
         }
 
         width = newWidth;
         height = newHeight;
-        cout << "size of rectangle changed" << endl;
+        if (!quiet) *console.info << "size of rectangle changed" << endl;
         return true;
     }
 
-    bool move(int newX, int newY) override {
-        if (newX + width > BOARD_WIDTH || newY + height > BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+    bool move(int newX, int newY, int boardWidth, int boardHeight, bool quiet = false) {
+        if (newX + width > boardWidth || newY + height > boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
@@ -464,94 +872,53 @@ private:
     int x, y, sideLength;
 
 public:
-    Square(string id, char color, bool fill, int x, int y, int sideLength) : Shape(id, color, fill), x(x), y(y), sideLength(sideLength) {}
+    Square(char color, bool fill, int x, int y, int sideLength) : Shape(color, fill), x(x), y(y), sideLength(sideLength) {}
 
-    void draw(vector<vector<char>>& grid) const override {
-        string colorCode = getColorCode(color);
-        string reset = resetColor();
-
-        for (int i = 0; i < sideLength; ++i) {
-            int topX = x + i;
-            int topY = y;
-            int bottomY = y + sideLength - 1;
-
-            if (topX >= 0 && topX < BOARD_WIDTH) {
-                if (topY >= 0 && topY < BOARD_HEIGHT) {
-                    grid[topY][topX] = color;
-                }
-                if (bottomY >= 0 && bottomY < BOARD_HEIGHT) {
-                    grid[bottomY][topX] = color;
-                }
-            }
-        }
-
-        for (int j = 0; j < sideLength; ++j) {
-            int leftX = x;
-            int rightX = x + sideLength - 1;
-            int drawY = y + j;
-
-            if (drawY >= 0 && drawY < BOARD_HEIGHT) {
-                if (leftX >= 0 && leftX < BOARD_WIDTH) {
-                    grid[drawY][leftX] = color;
-                }
-                if (rightX >= 0 && rightX < BOARD_WIDTH) {
-                    grid[drawY][rightX] = color;
-                }
-            }
-        }
+    template <typename Target>
+    void draw(Target& canvas, const Rect& clip) const {
+        drawBox(canvas, clip, x, y, sideLength, sideLength);
+    }
 
-        if (fill) {
-            for (int i = 1; i < sideLength - 1; i++) {
-                for (int j = 1; j < sideLength - 1; j++) {
-                    int fillX = x + j;
-                    int fillY = y + i;
-                    if (fillX >= 0 && fillX < BOARD_WIDTH && fillY >= 0 && fillY < BOARD_HEIGHT) {
-                        grid[fillY][fillX] = color;
-                    }
-                }
-            }
-        }
+    Rect getBounds() const {
+        return {x, y, x + max(sideLength, 0), y + max(sideLength, 0)};
+    }
 
-        for (int row = 0; row < BOARD_HEIGHT; ++row) {
-            cout << "|";
-            for (int col = 0; col < BOARD_WIDTH; ++col) {
-                if (grid[row][col] == color) {
-                    cout << colorCode << grid[row][col] << reset;
-                } else {
-                    cout << grid[row][col];
-                }
-            }
-            cout << "|" << endl;
-        }
+    string getDescription() const {
+        return "square " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(sideLength);
     }
 
-    string getDescription() const override {
-        return id + " square " + getColorName(color) + " " + (fill ? "fill" : "frame") + " " + to_string(x) + " " + to_string(y) + " " + to_string(sideLength);
+    ShapeRecord toRecord() const {
+        return {0, 0, color, fill, 0, x, y, sideLength, 0};
     }
 
-    bool containsPoint(int px, int py) const override {
+    bool containsPoint(int px, int py) const {
         return px >= x && px < x + sideLength && py >= y && py < y + sideLength;
     }
 
-    bool edit(const vector<int>& params) override {
+    int crossSection(double py, CrossSection& runs) const {
+        return boxCrossSection(py, runs, x, y, sideLength, sideLength);
+    }
+
+    bool edit(const vector<int>& params, int boardWidth, int boardHeight, bool quiet = false) {
         if (params.size() != 1) {
-            cout << "error: invalid argument count" << endl;
+            if (!quiet) *console.error << "error: invalid argument count" << endl;
             return false;
         }
 
         int newSideLength = params[0];
-        if (newSideLength <= 0 || x + newSideLength > BOARD_WIDTH || y + newSideLength > BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+        if (newSideLength <= 0 || x + newSideLength > boardWidth || y + newSideLength > boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
         sideLength = newSideLength;
-        cout << "size of square changed" << endl;
+        if (!quiet) *console.info << "size of square changed" << endl;
+        return true;
     }
 
-    bool move(int newX, int newY) override {
-        if (newX + sideLength > BOARD_WIDTH || newY + sideLength > BOARD_HEIGHT) {
-            cout << "error: shape will go out of the board" << endl;
+    bool move(int newX, int newY, int boardWidth, int boardHeight, bool quiet = false) {
+        if (newX + sideLength > boardWidth || newY + sideLength > boardHeight) {
+            if (!quiet) *console.error << "error: shape will go out of the board" << endl;
             return false;
         }
 
@@ -561,238 +928,3246 @@ public:
     }
 };
 
-class UserInterface {
-private:
-    Board board;
-
-public:
-    void run() {
-        string command;
-        cout << """Welcome to the Shapes Blackboard. Choose the command from the list:\n"
-                "1. draw\n"
-                "2. list\n"
-                "3. shapes\n"
-                "4. add\n"
-                "5. undo\n"
-                "6. clear\n"
-                "7. save\n"
-                "8. load\n"
-                "9. select\n"
-                "10. remove\n"
-                "11. edit\n"
-                "12. paint\n"
-                "13. move\n"
-                "14. exit\n""" << endl;
+// The alternative index is the record kind on disk, so new shapes go at the end.
+using ShapeData = variant<Triangle, Circle, Rectangle, Square>;
 
-        while (true) {
-            cout << ">";
-            getline(cin, command);
+ShapeRecord makeRecord(int id, const ShapeData& shape) {
+    ShapeRecord record = visit([](const auto& s) { return s.toRecord(); }, shape);
+    record.id = id;
+    record.kind = (uint8_t)shape.index();
+    return record;
+}
 
-            stringstream ss(command);
-            string cmd;
-            ss >> cmd;
-
-            if (cmd == "draw") {
-                drawBoard();
-            } else if (cmd == "list") {
-                listOfShapes();
-            } else if (cmd == "shapes") {
-                availableShapes();
-            } else if (cmd == "add") {
-                add(ss);
-            } else if (cmd == "undo") {
-                undo();
-            } else if (cmd == "clear") {
-                clear();
-            } else if (cmd == "save") {
-                string filename;
-                ss >> filename;
-                save(filename);
-            } else if (cmd == "load") {
-                string filename;
-                ss >> filename;
-                load(filename);
-            } else if (cmd == "select") {
-                select(ss);
-            } else if (cmd == "remove") {
-                remove();
-            } else if (cmd == "edit") {
-                edit(ss);
-            } else if (cmd == "paint") {
-                paint(ss);
-            } else if (cmd == "move") {
-                move(ss);
-            } else if (cmd == "exit") {
-                return;
-            } else {
-                cout << "Invalid command!" << endl;
-            }
-        }
+optional<ShapeData> shapeFromRecord(const ShapeRecord& record) {
+    if (colorIndex(record.color) == BLANK_CELL || !inCoordinateRange(record.x) || !inCoordinateRange(record.y) ||
+        !inCoordinateRange(record.a) || !inCoordinateRange(record.b)) {
+        return nullopt;
+    }
+    switch (record.kind) {
+        case 0: return Triangle(record.color, record.fill, record.x, record.y, record.a);
+        case 1: return Circle(record.color, record.fill, record.x, record.y, record.a);
+        case 2: return Rectangle(record.color, record.fill, record.x, record.y, record.a, record.b);
+        case 3: return Square(record.color, record.fill, record.x, record.y, record.a);
+        default: return nullopt;
     }
+}
 
-private:
+const size_t LOAD_BLOCK_SIZE = 8 << 20;
+const size_t MIN_PARSE_CHUNK = 256 << 10;
+
+struct ParsedShape {
+    int id;
+    size_t line;
+    ShapeData shape;
+};
+
+struct ParseError {
+    size_t line;
+    string message;
+};
+
+struct ParsedChunk {
+    vector<ParsedShape> shapes;
+    vector<ParseError> errors;
+    size_t lines = 0;
+};
+
+string_view nextToken(const char*& pos, const char* end) {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) ++pos;
+    const char* start = pos;
+    while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\r') ++pos;
+    return string_view(start, pos - start);
+}
+
+bool parseInts(const char*& pos, const char* end, int* values, int count) {
+    for (int i = 0; i < count; ++i) {
+        string_view token = nextToken(pos, end);
+        auto result = from_chars(token.data(), token.data() + token.size(), values[i]);
+        if (token.empty() || result.ec != errc() || result.ptr != token.data() + token.size() || !inCoordinateRange(values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parses one line of the text format without allocating unless the line is bad.
+void parseShapeLine(const char* pos, const char* end, size_t line, ParsedChunk& chunk) {
+    string_view id = nextToken(pos, end);
+    if (id.empty()) return;
+    string_view shapeType = nextToken(pos, end);
+    string_view color = nextToken(pos, end);
+    bool fill = nextToken(pos, end) == "fill";
+
+    int shapeId;
+    if (!parseShapeId(id, shapeId)) {
+        chunk.errors.push_back({line, "Invalid or duplicate shape id: " + string(id)});
+        return;
+    }
+    if (!isColor(color)) {
+        chunk.errors.push_back({line, "Unknown color: " + string(color)});
+        return;
+    }
+    char colorChar = color[0];
+
+    int v[4];
+    if (shapeType == "triangle" && parseInts(pos, end, v, 3)) {
+        chunk.shapes.push_back({shapeId, line, Triangle(colorChar, fill, v[0], v[1], v[2])});
+    } else if (shapeType == "circle" && parseInts(pos, end, v, 3)) {
+        chunk.shapes.push_back({shapeId, line, Circle(colorChar, fill, v[0], v[1], v[2])});
+    } else if (shapeType == "rectangle" && parseInts(pos, end, v, 4)) {
+        chunk.shapes.push_back({shapeId, line, Rectangle(colorChar, fill, v[0], v[1], v[2], v[3])});
+    } else if (shapeType == "square" && parseInts(pos, end, v, 3)) {
+        chunk.shapes.push_back({shapeId, line, Square(colorChar, fill, v[0], v[1], v[2])});
+    } else if (shapeType == "triangle" || shapeType == "circle" || shapeType == "rectangle" || shapeType == "square") {
+        chunk.errors.push_back({line, "Error parsing " + string(shapeType)});
+    } else {
+        chunk.errors.push_back({line, "Unknown shape type: " + string(shapeType)});
+    }
+}
+
+void parseChunk(const char* begin, const char* end, ParsedChunk& chunk) {
+    while (begin < end) {
+        const char* newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        const char* lineEnd = newline ? newline : end;
+        parseShapeLine(begin, lineEnd, chunk.lines++, chunk);
+        begin = newline ? newline + 1 : end;
+    }
+}
+
+// Splits the text at line boundaries and parses the pieces in parallel; chunks come back in file order.
+vector<ParsedChunk> parseText(const char* begin, const char* end) {
+    size_t size = end - begin;
+    size_t pieces = min<size_t>(max(1u, thread::hardware_concurrency()), size / MIN_PARSE_CHUNK + 1);
+    vector<const char*> cuts(1, begin);
+    for (size_t i = 1; i < pieces; ++i) {
+        const char* cut = max(begin + size * i / pieces, cuts.back());
+        const char* newline = static_cast<const char*>(memchr(cut, '\n', end - cut));
+        cuts.push_back(newline ? newline + 1 : end);
+    }
+    cuts.push_back(end);
+
+    vector<ParsedChunk> chunks(pieces);
+    vector<thread> workers;
+    for (size_t i = 1; i < pieces; ++i) {
+        workers.emplace_back(parseChunk, cuts[i], cuts[i + 1], ref(chunks[i]));
+    }
+    parseChunk(cuts[0], cuts[1], chunks[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return chunks;
+}
+
+const char BOARD_FILE_MAGIC[8] = {'B', 'B', 'O', 'A', 'R', 'D', '\r', '\n'};
+const uint32_t BOARD_FILE_VERSION = 1;
+
+struct BoardFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    int32_t width, height;
+    uint64_t checksum;
+};
+
+// FNV-1a over 64-bit words, with the tail folded in byte by byte.
+uint64_t boardChecksum(const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class MappedFile {
+private:
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+public:
+    explicit MappedFile(const string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            size = info.st_size;
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data != MAP_FAILED) munmap(data, size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return data != MAP_FAILED; }
+    const char* bytes() const { return static_cast<const char*>(data); }
+    size_t length() const { return size; }
+};
+
+string shapeIdName(int id) {
+    return "Shape" + to_string(id);
+}
+
+string describeShape(int id, const ShapeData& shape) {
+    return shapeIdName(id) + " " + visit([](const auto& s) { return s.getDescription(); }, shape);
+}
+
+Rect shapeBounds(const ShapeData& shape) {
+    return visit([](const auto& s) { return s.getBounds(); }, shape);
+}
+
+// Precomputed coverage of one shape geometry, as merged spans per row relative to the shape's origin.
+struct Stamp {
+    struct Span {
+        int32_t x0, x1;
+    };
+
+    int top = 0;
+    vector<uint32_t> rows;      // spans of row top + i are spans[rows[i] .. rows[i + 1])
+    vector<Span> spans;
+    mutable uint32_t mark = 0;
+
+    // Draws the stamp with its origin at (x, y) and returns the number of cells written.
+    uint64_t blit(Canvas& canvas, int x, int y, uint8_t color, const Rect& clip) const {
+        uint64_t pixels = 0;
+        int rowCount = (int)rows.size() - 1;
+        int first = max(0, clip.y0 - (y + top));
+        int last = min(rowCount, clip.y1 - (y + top));
+        for (int i = first; i < last; ++i) {
+            for (uint32_t k = rows[i]; k < rows[i + 1]; ++k) {
+                int x0 = max(x + spans[k].x0, clip.x0);
+                int x1 = min(x + spans[k].x1, clip.x1);
+                if (x0 < x1) {
+                    canvas.fillSpan(y + top + i, x0, x1, color);
+                    pixels += x1 - x0;
+                }
+            }
+        }
+        return pixels;
+    }
+};
+
+// Shares one stamp between all shapes of the same kind, dimensions and fill. Only the
+// editing thread touches the cache; renderers read the stamps it hands out. The cache owns
+// the stamps, so holders keep plain pointers and an occasional sweep drops unused ones.
+class StampCache {
+private:
+    struct Key {
+        uint8_t kind;
+        uint8_t fill;
+        int32_t a, b;
+
+        bool operator==(const Key& other) const {
+            return kind == other.kind && fill == other.fill && a == other.a && b == other.b;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            uint64_t h = ((uint64_t)(uint32_t)key.a << 32 | (uint32_t)key.b) * 0x9E3779B97F4A7C15ull;
+            return h ^ (h >> 29) ^ (key.kind << 1 | key.fill);
+        }
+    };
+
+    struct Recorder {
+        int originX, originY;
+        vector<pair<int, Stamp::Span>> spans;
+
+        void fillSpan(int y, int x0, int x1, uint8_t) {
+            spans.push_back({y - originY, {x0 - originX, x1 - originX}});
+        }
+    };
+
+    unordered_map<Key, unique_ptr<Stamp>, KeyHash> stamps;
+    size_t sweepAt = 1024;
+    uint32_t epoch = 0;
+
+    static unique_ptr<Stamp> build(const ShapeData& shape, const ShapeRecord& record, const Rect& clip) {
+        Recorder recorder{record.x, record.y, {}};
+        visit([&](const auto& s) { s.draw(recorder, clip); }, shape);
+        sort(recorder.spans.begin(), recorder.spans.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first || (a.first == b.first && a.second.x0 < b.second.x0);
+        });
+
+        auto stamp = make_unique<Stamp>();
+        if (recorder.spans.empty()) {
+            stamp->rows.push_back(0);
+            return stamp;
+        }
+        stamp->top = recorder.spans.front().first;
+        int row = stamp->top;
+        stamp->rows.push_back(0);
+        for (const auto& [y, span] : recorder.spans) {
+            while (row < y) {
+                stamp->rows.push_back(stamp->spans.size());
+                row++;
+            }
+            // Outline algorithms plot the same cells more than once; merge touching spans.
+            if ((int)stamp->spans.size() > (int)stamp->rows.back() && stamp->spans.back().x1 >= span.x0) {
+                stamp->spans.back().x1 = max(stamp->spans.back().x1, span.x1);
+            } else {
+                stamp->spans.push_back(span);
+            }
+        }
+        stamp->rows.push_back(stamp->spans.size());
+        return stamp;
+    }
+
+public:
+    const Stamp* get(const ShapeData& shape) {
+        ShapeRecord record = visit([](const auto& s) { return s.toRecord(); }, shape);
+        unique_ptr<Stamp>& cached = stamps[{(uint8_t)shape.index(), record.fill, record.a, record.b}];
+        if (!cached) {
+            cached = build(shape, record, shapeBounds(shape));
+        }
+        return cached.get();
+    }
+
+    // An unshared stamp holding only the part of the shape inside the clip, for shapes whose
+    // full geometry would dwarf the board.
+    static unique_ptr<Stamp> clipped(const ShapeData& shape, const Rect& clip) {
+        return build(shape, visit([](const auto& s) { return s.toRecord(); }, shape), clip);
+    }
+
+    bool wantsSweep() const {
+        return stamps.size() >= sweepAt;
+    }
+
+    // Keeps only the stamps that markUsed reports; the threshold doubles so sweeps stay amortized.
+    template <typename F>
+    void sweep(F&& markUsed) {
+        epoch++;
+        markUsed([&](const Stamp* stamp) { stamp->mark = epoch; });
+        for (auto it = stamps.begin(); it != stamps.end();) {
+            it = it->second->mark != epoch ? stamps.erase(it) : next(it);
+        }
+        sweepAt = max<size_t>(1024, stamps.size() * 2);
+    }
+};
+
+const uint32_t NO_SLOT = UINT32_MAX;
+
+// Open-addressing map from shape id to store slot; id 0 marks an empty bucket.
+class IdTable {
+private:
+    vector<int> keys;
+    vector<uint32_t> values;
+    size_t count = 0;
+
+    size_t home(int id) const {
+        return (size_t)((uint32_t)id * 2654435761u) & (keys.size() - 1);
+    }
+
+    void rehash(size_t buckets) {
+        vector<int> oldKeys = move(keys);
+        vector<uint32_t> oldValues = move(values);
+        keys.assign(buckets, 0);
+        values.assign(keys.size(), NO_SLOT);
+        count = 0;
+        for (size_t i = 0; i < oldKeys.size(); ++i) {
+            if (oldKeys[i] != 0) {
+                set(oldKeys[i], oldValues[i]);
+            }
+        }
+    }
+
+public:
+    uint32_t find(int id) const {
+        if (keys.empty() || id == 0) return NO_SLOT;
+        size_t mask = keys.size() - 1;
+        for (size_t i = home(id); keys[i] != 0; i = (i + 1) & mask) {
+            if (keys[i] == id) return values[i];
+        }
+        return NO_SLOT;
+    }
+
+    void set(int id, uint32_t slot) {
+        if ((count + 1) * 2 > keys.size()) {
+            rehash(max<size_t>(16, keys.size() * 2));
+        }
+        size_t mask = keys.size() - 1;
+        size_t i = home(id);
+        while (keys[i] != 0 && keys[i] != id) {
+            i = (i + 1) & mask;
+        }
+        if (keys[i] == 0) {
+            keys[i] = id;
+            count++;
+        }
+        values[i] = slot;
+    }
+
+    void erase(int id) {
+        if (keys.empty()) return;
+        size_t mask = keys.size() - 1;
+        size_t hole = home(id);
+        while (keys[hole] != id) {
+            if (keys[hole] == 0) return;
+            hole = (hole + 1) & mask;
+        }
+        // Backward-shift the rest of the probe run so lookups never need tombstones.
+        for (size_t next = (hole + 1) & mask; keys[next] != 0; next = (next + 1) & mask) {
+            size_t want = home(keys[next]);
+            bool stays = hole <= next ? (want > hole && want <= next) : (want > hole || want <= next);
+            if (!stays) {
+                keys[hole] = keys[next];
+                values[hole] = values[next];
+                hole = next;
+            }
+        }
+        keys[hole] = 0;
+        count--;
+    }
+
+    void reserve(size_t ids) {
+        size_t buckets = max<size_t>(16, keys.size());
+        while (buckets < ids * 2) buckets *= 2;
+        if (buckets > keys.size()) rehash(buckets);
+    }
+
+    void clear() {
+        fill(keys.begin(), keys.end(), 0);
+        count = 0;
+    }
+};
+
+// Shapes live in one contiguous array of slots; freed slots are reused, so the array stays dense.
+// Paint order is given by each slot's z key rather than by its position; the board keeps the
+// keys sorted in its ZOrder.
+class ShapeStore {
+private:
+    vector<ShapeData> shapes;
+    vector<int> ids;
+    vector<int64_t> zs;
+    vector<uint32_t> freeSlots;
+    IdTable slots;
+    size_t live = 0;
+
+public:
+    size_t size() const { return live; }
+    uint32_t end() const { return (uint32_t)shapes.size(); }
+    bool alive(uint32_t slot) const { return ids[slot] != 0; }
+    int idAt(uint32_t slot) const { return ids[slot]; }
+    int64_t zAt(uint32_t slot) const { return zs[slot]; }
+    const ShapeData& at(uint32_t slot) const { return shapes[slot]; }
+    ShapeData& at(uint32_t slot) { return shapes[slot]; }
+    uint32_t find(int id) const { return slots.find(id); }
+
+    size_t memoryBytes() const {
+        return shapes.capacity() * (sizeof(ShapeData) + sizeof(int) + sizeof(int64_t)) +
+               live * 2 * (sizeof(int) + sizeof(uint32_t));
+    }
+
+    uint32_t insert(int id, const ShapeData& shape, int64_t z) {
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            shapes[slot] = shape;
+            ids[slot] = id;
+            zs[slot] = z;
+        } else {
+            slot = end();
+            shapes.push_back(shape);
+            ids.push_back(id);
+            zs.push_back(z);
+        }
+        slots.set(id, slot);
+        live++;
+        return slot;
+    }
+
+    void erase(uint32_t slot) {
+        slots.erase(ids[slot]);
+        ids[slot] = 0;
+        freeSlots.push_back(slot);
+        live--;
+    }
+
+    void setZ(uint32_t slot, int64_t z) {
+        zs[slot] = z;
+    }
+
+    void reserve(size_t count) {
+        shapes.reserve(count);
+        ids.reserve(count);
+        zs.reserve(count);
+        slots.reserve(count);
+    }
+
+    void clear() {
+        shapes.clear();
+        ids.clear();
+        zs.clear();
+        freeSlots.clear();
+        slots.clear();
+        live = 0;
+    }
+};
+
+class FrameComposer {
+private:
+    string buffer;
+    vector<char> line;
+    Canvas shown{0, 0};
+    bool anchored = false;
+    bool shownValid = false;
+    bool flushConsole = true;
+    atomic<size_t> lastFrameBytes{0};
+    int output = STDOUT_FILENO;
+    FrameTally tally;
+
+    void appendBorder(int width) {
+        buffer += '+';
+        buffer.append(width, '-');
+        buffer += "+\n";
+    }
+
+    void appendCursor(int row, int col) {
+        buffer += "\033[";
+        buffer += to_string(row);
+        buffer += ';';
+        buffer += to_string(col);
+        buffer += 'H';
+    }
+
+    void flush() {
+        ScopedTimer timer(tally.write);
+        lastFrameBytes = buffer.size();
+        tally.frames++;
+        tally.bytes += buffer.size();
+        if (flushConsole) {
+            cout.flush();
+        }
+        const char* data = buffer.data();
+        size_t remaining = buffer.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(output, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            data += written;
+            remaining -= written;
+        }
+    }
+
+public:
+    void setOutput(int fd) {
+        output = fd;
+    }
+
+    // Off while frames are written from another thread, which must not touch cout.
+    void setConsoleFlush(bool on) {
+        flushConsole = on;
+    }
+
+    FrameTally& getTally() {
+        return tally;
+    }
+
+    // Pins the frame to the top of the terminal and scrolls command output below it,
+    // so later frames can be sent as cursor-addressed updates.
+    bool setAnchored(bool on, int frameRows) {
+        buffer.clear();
+        if (on) {
+            winsize size{};
+            int terminalRows = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 ? size.ws_row : 0;
+            if (terminalRows <= frameRows) {
+                return false;
+            }
+            buffer += "\033[2J";
+            buffer += "\033[" + to_string(frameRows + 1) + ";" + to_string(terminalRows) + "r";
+            appendCursor(frameRows + 1, 1);
+        } else if (anchored) {
+            buffer += "\033[r";
+            shown = Canvas(0, 0);
+        }
+        anchored = on;
+        shownValid = false;
+        flush();
+        return true;
+    }
+
+    bool isAnchored() const {
+        return anchored;
+    }
+
+    bool canUpdate() const {
+        return anchored && shownValid;
+    }
+
+    void forgetShown() {
+        shownValid = false;
+    }
+
+    void compose(const Canvas& grid) {
+        uint64_t start = nowNs();
+        int width = grid.getWidth();
+        buffer.clear();
+        if (anchored) {
+            buffer += "\0337\033[H";
+        }
+        appendBorder(width);
+
+        for (int y = 0; y < grid.getHeight(); ++y) {
+            const uint8_t* row = grid.row(y);
+            // Rows are written through a pointer into scratch room for an escape before every cell.
+            line.resize(size_t(width) * (MAX_ESCAPE_LENGTH + 1));
+            char* out = line.data();
+            uint8_t active = BLANK_CELL;
+            auto appendCells = [&](uint8_t cell, size_t count) {
+                // Spaces look the same in any foreground color, so only a colored cell can switch the escape.
+                if (cell != BLANK_CELL && cell != active) {
+                    string_view code = getColorCode(cell);
+                    memcpy(out, code.data(), code.size());
+                    out += code.size();
+                    active = cell;
+                }
+                memset(out, PALETTE[cell].code, count);
+                out += count;
+            };
+            // Walk runs of equal bytes; a byte holding one color twice is a run of single cells.
+            int pairs = width / 2;
+            for (int i = 0; i < pairs;) {
+                uint8_t pair = row[i];
+                int run = 1;
+                while (i + run < pairs && row[i + run] == pair) run++;
+                if ((pair & 0x0F) == pair >> 4) {
+                    appendCells(pair & 0x0F, 2 * size_t(run));
+                } else {
+                    for (int k = 0; k < run; ++k) {
+                        appendCells(pair & 0x0F, 1);
+                        appendCells(pair >> 4, 1);
+                    }
+                }
+                i += run;
+            }
+            if (width & 1) {
+                appendCells(Canvas::cellAt(row, width - 1), 1);
+            }
+            buffer += '|';
+            buffer.append(line.data(), out - line.data());
+            if (active != BLANK_CELL) {
+                buffer += resetColor();
+            }
+            buffer += "|\n";
+        }
+
+        appendBorder(width);
+        // Only live updates diff against the last frame, so plain draws skip the copy.
+        if (anchored) {
+            buffer += "\0338";
+            shown = grid;
+            shownValid = true;
+        }
+        tally.compose.add(nowNs() - start);
+        flush();
+    }
+
+    void composeUpdates(const Canvas& grid, const vector<Rect>& regions) {
+        uint64_t start = nowNs();
+        buffer.clear();
+        buffer += "\0337";
+        uint8_t active = BLANK_CELL;
+        for (const Rect& region : regions) {
+            for (int row = region.y0; row < region.y1; ++row) {
+                const uint8_t* cells = grid.row(row);
+                const uint8_t* shownCells = shown.row(row);
+                bool inRun = false;
+                for (int col = region.x0; col < region.x1; ++col) {
+                    // Unchanged byte pairs are skipped whole; most of a region usually is.
+                    if (!(col & 1) && col + 1 < region.x1 && cells[col >> 1] == shownCells[col >> 1]) {
+                        inRun = false;
+                        col++;
+                        continue;
+                    }
+                    uint8_t cell = Canvas::cellAt(cells, col);
+                    if (cell == Canvas::cellAt(shownCells, col)) {
+                        inRun = false;
+                        continue;
+                    }
+                    if (!inRun) {
+                        appendCursor(row + 2, col + 2);
+                        inRun = true;
+                    }
+                    if (cell != BLANK_CELL && cell != active) {
+                        buffer += getColorCode(cell);
+                        active = cell;
+                    }
+                    buffer += PALETTE[cell].code;
+                }
+                shown.copySpan(grid, row, region.x0, region.x1);
+            }
+        }
+        if (active != BLANK_CELL) {
+            buffer += resetColor();
+        }
+        buffer += "\0338";
+        tally.compose.add(nowNs() - start);
+        flush();
+    }
+
+    size_t getLastFrameBytes() const {
+        return lastFrameBytes;
+    }
+};
+
+const int MIN_INDEX_CELL_SIZE = 8;
+const long long MAX_INDEX_BUCKETS = 1 << 16;
+
+class SpatialIndex {
+private:
+    struct Entry {
+        Rect bounds;
+        uint32_t slot;
+    };
+
+    int width, height, cellSize, columns, rows;
+    vector<vector<Entry>> buckets;
+
+    static int cellSizeFor(int width, int height) {
+        int size = MIN_INDEX_CELL_SIZE;
+        while ((long long)((width + size - 1) / size) * ((height + size - 1) / size) > MAX_INDEX_BUCKETS) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    Rect cellsFor(const Rect& bounds) const {
+        Rect area = bounds.intersect({0, 0, width, height});
+        if (area.empty()) return {0, 0, 0, 0};
+        return {area.x0 / cellSize, area.y0 / cellSize, (area.x1 - 1) / cellSize + 1, (area.y1 - 1) / cellSize + 1};
+    }
+
+public:
+    SpatialIndex(int width, int height)
+        : width(width), height(height), cellSize(cellSizeFor(width, height)),
+          columns((width + cellSize - 1) / cellSize),
+          rows((height + cellSize - 1) / cellSize),
+          buckets(columns * rows) {}
+
+    void insert(uint32_t slot, const Rect& bounds) {
+        Rect cells = cellsFor(bounds);
+        for (int row = cells.y0; row < cells.y1; ++row) {
+            for (int col = cells.x0; col < cells.x1; ++col) {
+                buckets[row * columns + col].push_back({bounds, slot});
+            }
+        }
+    }
+
+    void remove(uint32_t slot, const Rect& bounds) {
+        Rect cells = cellsFor(bounds);
+        for (int row = cells.y0; row < cells.y1; ++row) {
+            for (int col = cells.x0; col < cells.x1; ++col) {
+                auto& bucket = buckets[row * columns + col];
+                for (size_t i = 0; i < bucket.size(); ++i) {
+                    if (bucket[i].slot == slot) {
+                        bucket[i] = bucket.back();
+                        bucket.pop_back();
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool hasSize(int w, int h) const {
+        return width == w && height == h;
+    }
+
+    // Empties every bucket but keeps its capacity for the next fill.
+    void clear() {
+        for (auto& bucket : buckets) {
+            bucket.clear();
+        }
+    }
+
+    uint32_t topmostAt(int x, int y, const ShapeStore& store) const {
+        if (x < 0 || x >= width || y < 0 || y >= height) return NO_SLOT;
+
+        uint32_t best = NO_SLOT;
+        const vector<Entry>& bucket = buckets[(y / cellSize) * columns + x / cellSize];
+        metrics.hitTests++;
+        metrics.hitTestShapesScanned += bucket.size();
+        for (const Entry& entry : bucket) {
+            if ((best == NO_SLOT || store.zAt(entry.slot) > store.zAt(best)) && entry.bounds.contains(x, y) &&
+                visit([&](const auto& shape) { return shape.containsPoint(x, y); }, store.at(entry.slot))) {
+                best = entry.slot;
+            }
+        }
+        return best;
+    }
+
+    // Slots whose bounds overlap the area, in painter's order.
+    vector<uint32_t> overlapping(const Rect& area, const ShapeStore& store) const {
+        vector<uint32_t> found;
+        Rect cells = cellsFor(area);
+        for (int row = cells.y0; row < cells.y1; ++row) {
+            for (int col = cells.x0; col < cells.x1; ++col) {
+                for (const Entry& entry : buckets[row * columns + col]) {
+                    if (entry.bounds.intersects(area)) {
+                        found.push_back(entry.slot);
+                    }
+                }
+            }
+        }
+        sort(found.begin(), found.end(), [&](uint32_t a, uint32_t b) {
+            return store.zAt(a) != store.zAt(b) ? store.zAt(a) < store.zAt(b) : a < b;
+        });
+        found.erase(unique(found.begin(), found.end()), found.end());
+        return found;
+    }
+};
+
+const size_t JOURNAL_BUDGET_BYTES = 256 << 20;
+const size_t SNAPSHOT_INTERVAL = 256;
+const size_t SNAPSHOT_COPY_RATIO = 16;
+
+// One undoable change. Entries are immutable once recorded, which keeps snapshot jumps valid.
+struct JournalEntry {
+    enum Kind : uint8_t { Add, Remove, Modify, Replace, Swap, Batch };
+
+    Kind kind = Add;
+    int id = 0;
+    int64_t zBefore = 0, zAfter = 0;
+    optional<ShapeData> before, after;
+    shared_ptr<const ShapeStore> storeBefore, storeAfter;
+    int otherId = 0;    // Swap exchanges the z keys of id and otherId
+    shared_ptr<const vector<JournalEntry>> parts;    // Batch applies these in order, undoes them in reverse
+
+    static JournalEntry add(int id, int64_t z, const ShapeData& shape) {
+        JournalEntry entry;
+        entry.kind = Add;
+        entry.id = id;
+        entry.zBefore = entry.zAfter = z;
+        entry.after = shape;
+        return entry;
+    }
+
+    static JournalEntry remove(int id, int64_t z, const ShapeData& shape) {
+        JournalEntry entry;
+        entry.kind = Remove;
+        entry.id = id;
+        entry.zBefore = entry.zAfter = z;
+        entry.before = shape;
+        return entry;
+    }
+
+    static JournalEntry modify(int id, int64_t zBefore, int64_t zAfter, const ShapeData& before, const ShapeData& after) {
+        JournalEntry entry;
+        entry.kind = Modify;
+        entry.id = id;
+        entry.zBefore = zBefore;
+        entry.zAfter = zAfter;
+        entry.before = before;
+        entry.after = after;
+        return entry;
+    }
+
+    static JournalEntry replace(shared_ptr<const ShapeStore> before, shared_ptr<const ShapeStore> after) {
+        JournalEntry entry;
+        entry.kind = Replace;
+        entry.storeBefore = move(before);
+        entry.storeAfter = move(after);
+        return entry;
+    }
+
+    static JournalEntry swap(int id, int64_t z, int otherId, int64_t otherZ) {
+        JournalEntry entry;
+        entry.kind = Swap;
+        entry.id = id;
+        entry.zBefore = z;
+        entry.zAfter = otherZ;
+        entry.otherId = otherId;
+        return entry;
+    }
+
+    static JournalEntry batch(vector<JournalEntry>&& parts) {
+        JournalEntry entry;
+        entry.kind = Batch;
+        entry.parts = make_shared<const vector<JournalEntry>>(move(parts));
+        return entry;
+    }
+
+    size_t memoryBytes() const {
+        size_t bytes = sizeof(JournalEntry);
+        if (storeBefore) bytes += storeBefore->memoryBytes();
+        if (storeAfter) bytes += storeAfter->memoryBytes();
+        if (parts) {
+            for (const JournalEntry& part : *parts) {
+                bytes += part.memoryBytes();
+            }
+        }
+        return bytes;
+    }
+};
+
+// Linear history with a cursor: entries before it are applied, the rest can be redone.
+// Positions are absolute so they stay stable when the oldest entries are trimmed.
+class Journal {
+private:
+    deque<JournalEntry> entries;
+    size_t base = 0;
+    size_t cursor = 0;
+    map<size_t, shared_ptr<const ShapeStore>> snapshots;
+    size_t bytes = 0;
+
+    void dropFront() {
+        bytes -= entries.front().memoryBytes();
+        entries.pop_front();
+        base++;
+        while (!snapshots.empty() && snapshots.begin()->first < base) {
+            bytes -= snapshots.begin()->second->memoryBytes();
+            snapshots.erase(snapshots.begin());
+        }
+    }
+
+    void dropBack() {
+        bytes -= entries.back().memoryBytes();
+        entries.pop_back();
+        while (!snapshots.empty() && snapshots.rbegin()->first > base + entries.size()) {
+            bytes -= snapshots.rbegin()->second->memoryBytes();
+            snapshots.erase(prev(snapshots.end()));
+        }
+    }
+
+public:
+    size_t first() const { return base; }
+    size_t last() const { return base + entries.size(); }
+    size_t position() const { return cursor; }
+    void setPosition(size_t target) { cursor = target; }
+    const JournalEntry& at(size_t position) const { return entries[position - base]; }
+
+    void record(JournalEntry entry, const ShapeStore& current) {
+        while (last() > cursor) {
+            dropBack();
+        }
+        bytes += entry.memoryBytes();
+        entries.push_back(move(entry));
+        cursor++;
+
+        // Snapshots get sparser as the board grows so their copies stay amortized O(1) per entry.
+        size_t lastSnapshot = snapshots.empty() ? base : snapshots.rbegin()->first;
+        if (cursor - lastSnapshot >= max(SNAPSHOT_INTERVAL, current.size()) &&
+            current.memoryBytes() * 8 <= JOURNAL_BUDGET_BYTES) {
+            auto snapshot = make_shared<const ShapeStore>(current);
+            bytes += snapshot->memoryBytes();
+            snapshots[cursor] = move(snapshot);
+        }
+
+        while (bytes > JOURNAL_BUDGET_BYTES && base < cursor) {
+            dropFront();
+        }
+        if (bytes > JOURNAL_BUDGET_BYTES) {
+            clear();
+        }
+    }
+
+    // Latest snapshot at or before the position, if any.
+    pair<size_t, shared_ptr<const ShapeStore>> snapshotAtOrBefore(size_t position) const {
+        auto it = snapshots.upper_bound(position);
+        if (it == snapshots.begin()) return {0, nullptr};
+        --it;
+        return *it;
+    }
+
+    void clear() {
+        entries.clear();
+        snapshots.clear();
+        base = cursor = 0;
+        bytes = 0;
+    }
+};
+
+// Paint order keyed by z: a treap whose nodes live in one pooled array and link by index.
+// Nodes are trivially destructible, so clear() releases everything at once, and a sorted
+// key list builds the tree in linear time.
+class ZOrder {
+public:
+    struct Node {
+        int64_t z;
+        uint32_t slot;
+        uint32_t priority;
+        uint32_t left, right;
+    };
+
+private:
+    static const uint32_t NIL = UINT32_MAX;
+
+    vector<Node> nodes;
+    vector<uint32_t> freeNodes;
+    uint32_t root = NIL;
+    uint32_t seed = 0x9E3779B9u;
+
+    uint32_t nextPriority() {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    uint32_t allocate(int64_t z, uint32_t slot) {
+        Node node{z, slot, nextPriority(), NIL, NIL};
+        if (!freeNodes.empty()) {
+            uint32_t index = freeNodes.back();
+            freeNodes.pop_back();
+            nodes[index] = node;
+            return index;
+        }
+        nodes.push_back(node);
+        return (uint32_t)nodes.size() - 1;
+    }
+
+    // Splits t into keys < z and keys >= z.
+    void split(uint32_t t, int64_t z, uint32_t& less, uint32_t& rest) {
+        if (t == NIL) {
+            less = rest = NIL;
+        } else if (nodes[t].z < z) {
+            split(nodes[t].right, z, nodes[t].right, rest);
+            less = t;
+        } else {
+            split(nodes[t].left, z, less, nodes[t].left);
+            rest = t;
+        }
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (a == NIL) return b;
+        if (b == NIL) return a;
+        if (nodes[a].priority > nodes[b].priority) {
+            nodes[a].right = merge(nodes[a].right, b);
+            return a;
+        }
+        nodes[b].left = merge(a, nodes[b].left);
+        return b;
+    }
+
+public:
+    void clear() {
+        nodes.clear();
+        freeNodes.clear();
+        root = NIL;
+    }
+
+    void insert(int64_t z, uint32_t slot) {
+        uint32_t less, rest;
+        split(root, z, less, rest);
+        root = merge(merge(less, allocate(z, slot)), rest);
+    }
+
+    void erase(int64_t z) {
+        uint32_t less, rest, match;
+        split(root, z, less, rest);
+        split(rest, z + 1, match, rest);
+        if (match != NIL) freeNodes.push_back(match);
+        root = merge(less, rest);
+    }
+
+    // Rebuilds from keys sorted by z with the classic stack-based Cartesian tree construction.
+    template <typename F>
+    void assignSorted(size_t count, F&& entryAt) {
+        clear();
+        nodes.reserve(count);
+        vector<uint32_t> spine;
+        for (size_t i = 0; i < count; ++i) {
+            auto [z, slot] = entryAt(i);
+            uint32_t node = allocate(z, slot);
+            uint32_t last = NIL;
+            while (!spine.empty() && nodes[spine.back()].priority < nodes[node].priority) {
+                last = spine.back();
+                spine.pop_back();
+            }
+            nodes[node].left = last;
+            if (!spine.empty()) nodes[spine.back()].right = node;
+            spine.push_back(node);
+        }
+        root = spine.empty() ? NIL : spine.front();
+    }
+
+    Node* find(int64_t z) {
+        uint32_t t = root;
+        while (t != NIL && nodes[t].z != z) {
+            t = z < nodes[t].z ? nodes[t].left : nodes[t].right;
+        }
+        return t == NIL ? nullptr : &nodes[t];
+    }
+
+    // Nearest node strictly above (or below) z, or nullptr.
+    const Node* neighbor(int64_t z, bool above) const {
+        uint32_t t = root, best = NIL;
+        while (t != NIL) {
+            if (above ? nodes[t].z > z : nodes[t].z < z) {
+                best = t;
+                t = above ? nodes[t].left : nodes[t].right;
+            } else {
+                t = above ? nodes[t].right : nodes[t].left;
+            }
+        }
+        return best == NIL ? nullptr : &nodes[best];
+    }
+
+    const Node* lowest() const {
+        uint32_t t = root;
+        while (t != NIL && nodes[t].left != NIL) t = nodes[t].left;
+        return t == NIL ? nullptr : &nodes[t];
+    }
+
+    // Visits slots bottom to top. Read-only, so render threads may walk the tree together.
+    template <typename F>
+    void forEachInOrder(F&& f) const {
+        vector<uint32_t> path;
+        uint32_t t = root;
+        while (t != NIL || !path.empty()) {
+            while (t != NIL) {
+                path.push_back(t);
+                t = nodes[t].left;
+            }
+            t = path.back();
+            path.pop_back();
+            f(nodes[t].slot);
+            t = nodes[t].right;
+        }
+    }
+};
+
+// Where and how a slot's shape is drawn, kept apart from the shape data so rendering never decodes it.
+struct Placement {
+    const Stamp* stamp;
+    Rect bounds;
+    int x, y;
+    uint8_t color;
+    bool filled;
+};
+
+// Only filled shapes at least this wide, and at least 1/OCCLUDER_BAND_FRACTION of the band, occlude.
+// Tracking every small fill costs more than the overdraw it saves.
+const int MIN_OCCLUDER_WIDTH = 4;
+const int OCCLUDER_BAND_FRACTION = 16;
+
+// Per-thread working set of the occlusion pass, reused across bands.
+struct OcclusionScratch {
+    struct Piece {
+        int y, x0, x1;
+    };
+
+    struct Op {
+        uint32_t slot;
+        uint32_t first, last;   // clipped pieces; an empty range means the whole stamp is visible
+    };
+
+    vector<vector<pair<int, int>>> coverage;   // merged covered intervals per band row
+    vector<Op> ops;
+    vector<Piece> pieces;
+
+    void reset(int rows) {
+        if ((int)coverage.size() < rows) coverage.resize(rows);
+        for (int i = 0; i < rows; ++i) coverage[i].clear();
+        ops.clear();
+        pieces.clear();
+    }
+
+    static vector<pair<int, int>>::const_iterator firstCovering(const vector<pair<int, int>>& covered, int x) {
+        return lower_bound(covered.begin(), covered.end(), x, [](const pair<int, int>& c, int v) { return c.second <= v; });
+    }
+
+    static void cover(vector<pair<int, int>>& covered, int x0, int x1) {
+        auto first = lower_bound(covered.begin(), covered.end(), x0, [](const pair<int, int>& c, int x) { return c.second < x; });
+        auto last = first;
+        while (last != covered.end() && last->first <= x1) {
+            x0 = min(x0, last->first);
+            x1 = max(x1, last->second);
+            ++last;
+        }
+        if (first == last) {
+            covered.insert(first, {x0, x1});
+        } else {
+            *first = {x0, x1};
+            covered.erase(first + 1, last);
+        }
+    }
+};
+
+thread_local OcclusionScratch occlusionScratch;
+
+const size_t MAX_DIRTY_REGIONS = 16;
+const long long MAX_STAMP_BOARD_RATIO = 4;
+const long long PARALLEL_MIN_CELLS = 1 << 16;
+const int BANDS_PER_THREAD = 4;
+const int MAX_RENDER_THREADS = 256;
+
+const int MAX_EXPORT_SIDE = 1 << 20;
+const int MAX_EXPORT_SAMPLES = 8;
+const size_t EXPORT_BAND_BYTES = 4 << 20;
+const int EXPORT_BANDS_PER_THREAD = 2;
+
+// Renders the board into a binary PPM or PGM image, `scale` pixels per cell, from the exact
+// geometry of each shape rather than its cells. Every pixel takes samples x samples coverage
+// samples, so curved and slanted edges blend with what lies below them. At scale 1 with one
+// sample the pixels are copied from the board's cells instead, so the image matches `draw`.
+// Bands of rows are rendered in parallel and written in order; no more than a couple of bands
+// per thread are in memory at once, whatever the image size.
+class ImageExporter {
+private:
+    struct Band {
+        vector<uint8_t> pixels;
+        bool ready = false;
+    };
+
+    const ShapeStore& store;
+    const SpatialIndex& index;
+    const Canvas* cells;
+    int scale, samples, threads;
+    int channels;
+    int width, height;
+    int bandRows, bandCount;
+    size_t rowBytes;
+
+    static void addRange(vector<int>& deltas, long long first, long long last, int amount) {
+        deltas[first] += amount;
+        deltas[last] -= amount;
+    }
+
+    // Adds the samples in subpixel columns [k0, k1) to the coverage of the pixels holding them.
+    // Coverage is kept as differences between neighbors, so a run costs O(1) however long it is.
+    void cover(vector<int>& deltas, long long k0, long long k1) const {
+        if (k0 >= k1) return;
+        long long first = k0 / samples;
+        long long last = (k1 - 1) / samples;
+        if (first == last) {
+            addRange(deltas, first, first + 1, k1 - k0);
+            return;
+        }
+        addRange(deltas, first, first + 1, samples * (first + 1) - k0);
+        addRange(deltas, first + 1, last, samples);
+        addRange(deltas, last, last + 1, k1 - samples * last);
+    }
+
+    array<uint8_t, 3> inkOf(uint8_t color) const {
+        const PaletteColor& entry = PALETTE[color];
+        if (channels == 1) {
+            return {uint8_t((299 * entry.red + 587 * entry.green + 114 * entry.blue + 500) / 1000), 0, 0};
+        }
+        return {entry.red, entry.green, entry.blue};
+    }
+
+    void copyCells(uint8_t* pixels, int top, int bottom) const {
+        array<array<uint8_t, 3>, size(PALETTE)> inks;
+        for (uint8_t color = 0; color < size(PALETTE); ++color) {
+            inks[color] = inkOf(color);
+        }
+        for (int py = top; py < bottom; ++py) {
+            const uint8_t* row = cells->row(py);
+            uint8_t* out = pixels + (size_t)(py - top) * rowBytes;
+            for (int px = 0; px < width; ++px) {
+                memcpy(out + (size_t)px * channels, inks[Canvas::cellAt(row, px)].data(), channels);
+            }
+        }
+    }
+
+    void paintShape(const ShapeData& shape, uint8_t* pixels, int top, int bottom, vector<int>& deltas) const {
+        Rect bounds = shapeBounds(shape);
+        int x0 = max(0LL, (long long)bounds.x0 * scale);
+        int x1 = min<long long>(width, (long long)bounds.x1 * scale);
+        int y0 = max<long long>(top, (long long)bounds.y0 * scale);
+        int y1 = min<long long>(bottom, (long long)bounds.y1 * scale);
+        if (x0 >= x1 || y0 >= y1) return;
+
+        array<uint8_t, 3> ink = inkOf(colorIndex(visit([](const auto& s) { return s.getColor(); }, shape)));
+        int full = samples * samples;
+        double step = 1.0 / (scale * samples);
+        long long lowest = (long long)x0 * samples;
+        long long highest = (long long)x1 * samples;
+
+        CrossSection runs;
+        for (int py = y0; py < y1; ++py) {
+            fill(deltas.begin() + x0, deltas.begin() + x1 + 1, 0);
+            for (int row = 0; row < samples; ++row) {
+                int count = visit([&](const auto& s) { return s.crossSection((py * samples + row + 0.5) * step, runs); }, shape);
+                if (count == 2 && runs[1].first <= runs[0].second) {
+                    runs[0].second = max(runs[0].second, runs[1].second);
+                    count = 1;
+                }
+                // Sample k sits at k + 0.5 subpixels, so a run covers the samples from ceil(edge - 0.5).
+                for (int i = 0; i < count; ++i) {
+                    long long k0 = max(lowest, (long long)ceil(runs[i].first / step - 0.5));
+                    long long k1 = min(highest, (long long)ceil(runs[i].second / step - 0.5));
+                    cover(deltas, k0, k1);
+                }
+            }
+
+            uint8_t* out = pixels + (size_t)(py - top) * rowBytes;
+            int weight = 0;
+            for (int px = x0; px < x1; ++px) {
+                weight += deltas[px];
+                if (weight == 0) continue;
+                uint8_t* pixel = out + (size_t)px * channels;
+                for (int c = 0; c < channels; ++c) {
+                    pixel[c] = weight == full ? ink[c] : pixel[c] + ((ink[c] - pixel[c]) * weight + full / 2) / full;
+                }
+            }
+        }
+    }
+
+    void renderBand(int band, vector<uint8_t>& pixels, vector<int>& deltas) const {
+        int top = band * bandRows;
+        int bottom = min(height, top + bandRows);
+        pixels.assign((size_t)(bottom - top) * rowBytes, 255);
+        if (cells) {
+            copyCells(pixels.data(), top, bottom);
+            return;
+        }
+        Rect area{0, top / scale, width / scale, (bottom + scale - 1) / scale};
+        for (uint32_t slot : index.overlapping(area, store)) {
+            paintShape(store.at(slot), pixels.data(), top, bottom, deltas);
+        }
+    }
+
+public:
+    // `cells` is the board's rendered canvas; it is only read at scale 1 with one sample.
+    ImageExporter(const ShapeStore& store, const SpatialIndex& index, const Canvas& canvas,
+                  int scale, int samples, int threads, bool gray)
+        : store(store), index(index), cells(scale == 1 && samples == 1 ? &canvas : nullptr), scale(scale), samples(samples), threads(threads), channels(gray ? 1 : 3),
+          width(canvas.getWidth() * scale), height(canvas.getHeight() * scale), rowBytes((size_t)width * channels) {
+        bandRows = (int)clamp<size_t>(EXPORT_BAND_BYTES / rowBytes, 1, height);
+        bandCount = (height + bandRows - 1) / bandRows;
+    }
+
+    bool write(ostream& out) {
+        out << (channels == 1 ? "P5" : "P6") << '\n' << width << ' ' << height << "\n255\n";
+
+        int window = threads * EXPORT_BANDS_PER_THREAD;
+        vector<Band> bands(window);
+        int claimed = 0, written = 0;
+        bool stopping = false;
+        mutex lock;
+        condition_variable changed;
+
+        auto worker = [&]() {
+            vector<int> deltas(width + 1);
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                changed.wait(guard, [&]() { return stopping || claimed == bandCount || claimed < written + window; });
+                if (stopping || claimed == bandCount) return;
+                int band = claimed++;
+                Band& slot = bands[band % window];
+                guard.unlock();
+                renderBand(band, slot.pixels, deltas);
+                guard.lock();
+                slot.ready = true;
+                changed.notify_all();
+            }
+        };
+        vector<thread> workers;
+        for (int i = 0; i < min(threads, bandCount); ++i) {
+            workers.emplace_back(worker);
+        }
+
+        for (; written < bandCount && out.good(); ) {
+            Band& slot = bands[written % window];
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() { return slot.ready; });
+            }
+            out.write(reinterpret_cast<const char*>(slot.pixels.data()), slot.pixels.size());
+            lock_guard<mutex> guard(lock);
+            slot.ready = false;
+            written++;
+            changed.notify_all();
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+        return out.good();
+    }
+};
+
+// One fixed-size entry of the write-ahead log. A record whose checksum fails marks the torn
+// end of a log cut short by a crash.
+struct LogRecord {
+    enum Op : uint8_t { Put, Erase, SetZ, Clear, Resize };
+
+    uint8_t op;
+    uint8_t reserved[7];
+    int64_t z;
+    ShapeRecord shape;
+    uint64_t checksum;
+
+    void seal() { checksum = boardChecksum(this, offsetof(LogRecord, checksum)); }
+    bool intact() const { return checksum == boardChecksum(this, offsetof(LogRecord, checksum)); }
+};
+
+const char SNAPSHOT_FILE_MAGIC[8] = {'B', 'B', 'S', 'N', 'A', 'P', '\r', '\n'};
+
+// A snapshot holds the board as it was before log.<generation>, with z values kept so the
+// records that follow it land in the same paint order.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t generation;
+    uint64_t count;
+    int32_t width, height;
+    uint64_t checksum;
+};
+
+struct SnapshotEntry {
+    ShapeRecord shape;
+    int64_t z;
+};
+
+const uint64_t LOG_COMPACT_MIN_RECORDS = 4096;
+const char* const UNSAVED_CHANGE_ERROR = "error: the write-ahead log failed, this change may be lost";
+
+// Makes every board change durable in O(change): records go to an append-only log that a
+// flusher thread writes and fdatasyncs in groups, one sync for whatever piled up during the
+// last one. A command is not answered until waitDurable() sees its records synced, so a crash
+// loses only commands that were never acknowledged. A failed write or sync is cut back off the
+// log and is final: waiting commands get an error instead of an acknowledgement, and the board
+// takes no more edits. Once the log tail outgrows the board, the board is copied, the log
+// rotates to a new generation and a background thread writes the copy as the new snapshot.
+class WriteAheadLog {
+private:
+    struct Batch {
+        int fd;
+        vector<LogRecord> records;
+        bool last;
+        uint64_t through;   // sequence number of the newest record queued here
+    };
+
+    string directory;
+    uint64_t generation = 0;
+    uint64_t tailRecords = 0;
+    deque<Batch> queue;
+    uint64_t appended = 0;
+    uint64_t synced = 0;
+    atomic<bool> failed{false};   // sticky: once a write fails nothing more is written or acknowledged
+    bool stopping = false;
+    mutex lock;
+    condition_variable wake;
+    condition_variable durable;
+    thread flusher;
+    thread compactor;
+    atomic<bool> compacting{false};
+
+    string logPath(uint64_t gen) const { return directory + "/log." + to_string(gen); }
+    string snapshotPath() const { return directory + "/snapshot"; }
+
+    bool hasWork() const {
+        return !queue.empty() && (!queue.front().records.empty() || queue.front().last);
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd, bytes, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            bytes += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&]() { return stopping || hasWork(); });
+            if (!hasWork()) return;
+            Batch& front = queue.front();
+            vector<LogRecord> records = move(front.records);
+            front.records.clear();
+            int fd = front.fd;
+            bool last = front.last;
+            uint64_t through = front.through;
+            if (last) queue.pop_front();
+            guard.unlock();
+
+            bool written = true;
+            if (!records.empty() && !failed) {
+                // A failed write is cut back off so no torn record sits in front of later ones.
+                off_t end = lseek(fd, 0, SEEK_END);
+                written = writeAll(fd, records.data(), records.size() * sizeof(LogRecord)) && fdatasync(fd) == 0;
+                if (!written) {
+                    cerr << "Write-ahead log error, edits are disabled: " << strerror(errno) << endl;
+                    if (end >= 0 && ftruncate(fd, end) == 0) fdatasync(fd);
+                }
+                metrics.logRecords += records.size();
+                metrics.logSyncs++;
+            }
+            if (last) close(fd);
+            guard.lock();
+            if (!written || failed) {
+                failed = true;
+            } else {
+                synced = max(synced, through);
+            }
+            durable.notify_all();
+        }
+    }
+
+    // Runs on the compactor thread; old logs go only once the snapshot covering them is durable.
+    void writeSnapshot(uint64_t gen, const ShapeStore& shapes, int width, int height) {
+        vector<SnapshotEntry> entries;
+        entries.reserve(shapes.size());
+        for (uint32_t slot = 0; slot < shapes.end(); ++slot) {
+            if (shapes.alive(slot)) {
+                entries.push_back({makeRecord(shapes.idAt(slot), shapes.at(slot)), shapes.zAt(slot)});
+            }
+        }
+        SnapshotHeader header{};
+        memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+        header.generation = gen;
+        header.count = entries.size();
+        header.width = width;
+        header.height = height;
+        header.checksum = boardChecksum(entries.data(), entries.size() * sizeof(SnapshotEntry));
+
+        string temporary = snapshotPath() + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool written = fd >= 0 && writeAll(fd, &header, sizeof(header)) &&
+                       writeAll(fd, entries.data(), entries.size() * sizeof(SnapshotEntry)) && fsync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (!written || rename(temporary.c_str(), snapshotPath().c_str()) != 0) {
+            cerr << "Cannot write snapshot in " << directory << ": " << strerror(errno) << endl;
+            return;
+        }
+        int dir = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
+        for (uint64_t old = gen - 1; old > 0 && unlink(logPath(old).c_str()) == 0; --old) {
+        }
+        metrics.logCompactions++;
+    }
+
+    static void replay(const LogRecord& record, ShapeStore& shapes, int& width, int& height) {
+        uint32_t slot = shapes.find(record.shape.id);
+        switch (record.op) {
+            case LogRecord::Put:
+                if (optional<ShapeData> shape = shapeFromRecord(record.shape)) {
+                    if (slot == NO_SLOT) {
+                        shapes.insert(record.shape.id, *shape, record.z);
+                    } else {
+                        shapes.at(slot) = *shape;
+                        shapes.setZ(slot, record.z);
+                    }
+                }
+                break;
+            case LogRecord::Erase:
+                if (slot != NO_SLOT) shapes.erase(slot);
+                break;
+            case LogRecord::SetZ:
+                if (slot != NO_SLOT) shapes.setZ(slot, record.z);
+                break;
+            case LogRecord::Clear:
+                shapes.clear();
+                break;
+            case LogRecord::Resize:
+                if (validBoardSize(record.shape.x, record.shape.y)) {
+                    width = record.shape.x;
+                    height = record.shape.y;
+                }
+                break;
+        }
+    }
+
+    void append(LogRecord record) {
+        record.seal();
+        {
+            lock_guard<mutex> guard(lock);
+            queue.back().records.push_back(record);
+            queue.back().through = ++appended;
+            tailRecords++;
+        }
+        wake.notify_one();
+    }
+
+public:
+    explicit WriteAheadLog(const string& directory) : directory(directory) {}
+
+    ~WriteAheadLog() {
+        if (flusher.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            flusher.join();
+        }
+        if (compactor.joinable()) compactor.join();
+        for (const Batch& batch : queue) {
+            close(batch.fd);
+        }
+    }
+
+    // Rebuilds the board from the snapshot and the logs after it. A torn record ends the
+    // replay; its log is cut back to the last intact record and anything later is dropped.
+    // Returns the number of records replayed, or -1 if the directory or snapshot is unusable.
+    long long recover(ShapeStore& shapes, int& width, int& height) {
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Cannot create " << directory << ": " << strerror(errno) << endl;
+            return -1;
+        }
+        uint64_t gen = 1;
+        MappedFile snapshot(snapshotPath());
+        if (snapshot.isOpen()) {
+            SnapshotHeader header;
+            size_t tableSize = 0;
+            if (snapshot.length() >= sizeof(header)) {
+                memcpy(&header, snapshot.bytes(), sizeof(header));
+                tableSize = header.count * sizeof(SnapshotEntry);
+            }
+            if (snapshot.length() < sizeof(header) || memcmp(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+                header.count > snapshot.length() / sizeof(SnapshotEntry) || snapshot.length() != sizeof(header) + tableSize ||
+                boardChecksum(snapshot.bytes() + sizeof(header), tableSize) != header.checksum) {
+                cerr << "Corrupt snapshot: " << snapshotPath() << endl;
+                return -1;
+            }
+            const SnapshotEntry* entries = reinterpret_cast<const SnapshotEntry*>(snapshot.bytes() + sizeof(header));
+            shapes.reserve(header.count);
+            for (size_t i = 0; i < header.count; ++i) {
+                optional<ShapeData> shape = shapeFromRecord(entries[i].shape);
+                if (shape && entries[i].shape.id > 0 && shapes.find(entries[i].shape.id) == NO_SLOT) {
+                    shapes.insert(entries[i].shape.id, *shape, entries[i].z);
+                }
+            }
+            if (validBoardSize(header.width, header.height)) {
+                width = header.width;
+                height = header.height;
+            }
+            gen = header.generation;
+            metrics.fileBytesRead += snapshot.length();
+        }
+
+        long long replayed = 0;
+        generation = gen - 1;
+        for (bool torn = false; !torn; ++gen) {
+            MappedFile log(logPath(gen));
+            if (!log.isOpen()) {
+                struct stat info;
+                if (stat(logPath(gen).c_str(), &info) != 0) break;
+            }
+            generation = gen;
+            size_t intact = 0;
+            for (; intact + sizeof(LogRecord) <= log.length(); intact += sizeof(LogRecord)) {
+                LogRecord record;
+                memcpy(&record, log.bytes() + intact, sizeof(record));
+                if (!record.intact()) break;
+                replay(record, shapes, width, height);
+                replayed++;
+            }
+            metrics.fileBytesRead += log.length();
+            if (intact < log.length()) {
+                torn = true;
+                if (truncate(logPath(gen).c_str(), intact) != 0) {
+                    cerr << "Cannot truncate " << logPath(gen) << ": " << strerror(errno) << endl;
+                    return -1;
+                }
+                for (uint64_t later = gen + 1; unlink(logPath(later).c_str()) == 0; ++later) {
+                }
+            }
+        }
+        return replayed;
+    }
+
+    // Starts logging on top of the recovered board, which becomes the first snapshot.
+    void start(const ShapeStore& shapes, int width, int height) {
+        flusher = thread([this]() { flushLoop(); });
+        compact(shapes, width, height);
+    }
+
+    void put(int id, const ShapeData& shape, int64_t z) {
+        LogRecord record{};
+        record.op = LogRecord::Put;
+        record.z = z;
+        record.shape = makeRecord(id, shape);
+        append(record);
+    }
+
+    void erase(int id) {
+        LogRecord record{};
+        record.op = LogRecord::Erase;
+        record.shape.id = id;
+        append(record);
+    }
+
+    void setZ(int id, int64_t z) {
+        LogRecord record{};
+        record.op = LogRecord::SetZ;
+        record.z = z;
+        record.shape.id = id;
+        append(record);
+    }
+
+    void clear() {
+        LogRecord record{};
+        record.op = LogRecord::Clear;
+        append(record);
+    }
+
+    void resize(int width, int height) {
+        LogRecord record{};
+        record.op = LogRecord::Resize;
+        record.shape.x = width;
+        record.shape.y = height;
+        append(record);
+    }
+
+    // Blocks until every record appended so far is synced; false if the log failed first.
+    // Callers that wait together share one sync.
+    bool waitDurable() {
+        unique_lock<mutex> guard(lock);
+        uint64_t target = appended;
+        durable.wait(guard, [&]() { return synced >= target || failed; });
+        return synced >= target;
+    }
+
+    bool hasFailed() const {
+        return failed;
+    }
+
+    // Compaction pays O(board) once the log has grown by as much, so each change stays O(1).
+    bool wantsCompaction(size_t shapes) const {
+        return !compacting && !failed && tailRecords > max<uint64_t>(LOG_COMPACT_MIN_RECORDS, shapes);
+    }
+
+    void compact(const ShapeStore& shapes, int width, int height) {
+        if (compactor.joinable()) compactor.join();
+        uint64_t next = generation + 1;
+        int fd = open(logPath(next).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            cerr << "Cannot open " << logPath(next) << ": " << strerror(errno) << endl;
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            if (!queue.empty()) queue.back().last = true;
+            queue.push_back({fd, {}, false, appended});
+            generation = next;
+            tailRecords = 0;
+        }
+        wake.notify_one();
+        compacting = true;
+        compactor = thread([this, next, copy = ShapeStore(shapes), width, height]() {
+            writeSnapshot(next, copy, width, height);
+            compacting = false;
+        });
+    }
+};
+
+// What server readers see of the board: shapes in paint order, their hit-test index and the
+// rendered canvas. Published once and never modified, so readers need no locks.
+struct BoardSnapshot {
+    uint64_t version;
+    ShapeStore store;
+    ZOrder zorder;
+    SpatialIndex index;
+    Canvas canvas;
+};
+
+// Composes and writes frames on its own thread so a slow terminal never stalls the input loop.
+// Three canvases rotate: the loop copies finished frames into `back`, the writer works from
+// `front`, and `ready` holds the newest frame nobody has claimed yet. Publishing over an
+// unclaimed frame drops it, and its dirty regions carry over so the diff stays complete.
+class FramePresenter {
+private:
+    struct Frame {
+        Canvas canvas{0, 0};
+        vector<Rect> regions;
+    };
+
+    FrameComposer& composer;
+    Frame frames[3];
+    int back = 0, ready = 1, front = 2;
+    bool pending = false;
+    bool writing = false;
+    bool stopping = false;
+    uint64_t dropped = 0;
+    FrameTally tally;
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    thread writer;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&]() { return pending || stopping; });
+            if (!pending) return;
+            swap(ready, front);
+            pending = false;
+            writing = true;
+            guard.unlock();
+
+            const Frame& frame = frames[front];
+            if (!composer.canUpdate()) {
+                composer.compose(frame.canvas);
+            } else {
+                composer.composeUpdates(frame.canvas, frame.regions);
+            }
+
+            guard.lock();
+            tally.merge(composer.getTally());
+            composer.getTally() = FrameTally();
+            writing = false;
+            idle.notify_all();
+        }
+    }
+
+public:
+    explicit FramePresenter(FrameComposer& composer) : composer(composer) {}
+
+    ~FramePresenter() {
+        stop();
+    }
+
+    bool running() const {
+        return writer.joinable();
+    }
+
+    void start() {
+        if (running()) return;
+        composer.setConsoleFlush(false);
+        writer = thread([this]() { run(); });
+    }
+
+    // Writes whatever is still pending, then hands the composer back to the caller's thread.
+    void stop() {
+        if (!running()) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        stopping = false;
+        composer.setConsoleFlush(true);
+    }
+
+    void publish(const Canvas& grid, const vector<Rect>& regions) {
+        Frame& frame = frames[back];
+        frame.canvas = grid;
+        frame.regions = regions;
+
+        lock_guard<mutex> guard(lock);
+        if (pending) {
+            // The diff skips unchanged cells, so too many regions just collapse into their bounds.
+            const vector<Rect>& stale = frames[ready].regions;
+            frame.regions.insert(frame.regions.end(), stale.begin(), stale.end());
+            if (frame.regions.size() > MAX_DIRTY_REGIONS) {
+                Rect all = {0, 0, 0, 0};
+                for (const Rect& r : frame.regions) {
+                    all = all.unite(r);
+                }
+                frame.regions.assign(1, all);
+            }
+            dropped++;
+        }
+        swap(back, ready);
+        pending = true;
+        wake.notify_one();
+    }
+
+    void drainInto(Metrics& target) {
+        lock_guard<mutex> guard(lock);
+        tally.drainInto(target);
+        target.framesDropped += dropped;
+        dropped = 0;
+    }
+};
+
+class Board{
+private:
+    Canvas grid;
+    ShapeStore store;
+    int selectedId = 0;
+    vector<int> region;    // ids picked by `select rect`, used instead of selectedId when not empty
+    SpatialIndex index;
+    int nextId = 1;
+    int64_t nextZ = 0;
+    Journal journal;
+    ZOrder zorder;
+    StampCache stamps;
+    unordered_map<uint32_t, unique_ptr<Stamp>> clippedStamps;
+    vector<Placement> placements;
+    vector<Rect> dirty;
+    int renderThreads = 1;
+    bool occlusionCulling = true;
+    FrameComposer composer;
+    FramePresenter presenter{composer};
+    WriteAheadLog* changeLog = nullptr;
+
+    Rect boardRect() const {
+        return grid.bounds();
+    }
+
+    void markDirty(const Rect& area) {
+        Rect region = area.intersect(boardRect());
+        if (region.empty()) return;
+
+        for (size_t i = 0; i < dirty.size();) {
+            if (dirty[i].intersects(region)) {
+                region = region.unite(dirty[i]);
+                dirty.erase(dirty.begin() + i);
+                i = 0;
+            } else {
+                ++i;
+            }
+        }
+        dirty.push_back(region);
+
+        if (dirty.size() > MAX_DIRTY_REGIONS) {
+            Rect all = {0, 0, 0, 0};
+            for (const Rect& r : dirty) {
+                all = all.unite(r);
+            }
+            dirty.assign(1, all);
+        }
+    }
+
+    void drawSlot(uint32_t slot, const Rect& clip) {
+        const Placement& placement = placements[slot];
+        rasterTally.pixels += placement.stamp->blit(grid, placement.x, placement.y, placement.color, clip);
+        rasterTally.shapes++;
+    }
+
+    void place(uint32_t slot) {
+        if (placements.size() <= slot) {
+            placements.resize(store.end());
+        }
+        if (stamps.wantsSweep()) {
+            stamps.sweep([&](auto&& markUsed) {
+                for (const Placement& placement : placements) {
+                    if (placement.stamp) markUsed(placement.stamp);
+                }
+            });
+        }
+        const ShapeData& shape = store.at(slot);
+        ShapeRecord record = visit([](const auto& s) { return s.toRecord(); }, shape);
+        Rect bounds = shapeBounds(shape);
+        const Stamp* stamp;
+        if ((long long)(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0) > MAX_STAMP_BOARD_RATIO * grid.getWidth() * grid.getHeight()) {
+            unique_ptr<Stamp>& owned = clippedStamps[slot];
+            owned = StampCache::clipped(shape, boardRect());
+            stamp = owned.get();
+        } else {
+            if (!clippedStamps.empty()) clippedStamps.erase(slot);
+            stamp = stamps.get(shape);
+        }
+        placements[slot] = {stamp, bounds, record.x, record.y, colorIndex(record.color), record.fill != 0};
+    }
+
+    // Walks the shapes top-down, clipping each against the filled shapes above it, then paints
+    // the survivors bottom-up so outlines above still overwrite whatever lies under them.
+    void drawVisible(const Rect& band, const vector<uint32_t>& shapes) {
+        int occluderWidth = max(MIN_OCCLUDER_WIDTH, (band.x1 - band.x0) / OCCLUDER_BAND_FRACTION);
+        auto occludes = [&](const Placement& placement) {
+            return placement.filled && min(placement.bounds.x1, band.x1) - max(placement.bounds.x0, band.x0) >= occluderWidth;
+        };
+        size_t top = shapes.size();
+        while (top > 0 && !occludes(placements[shapes[top - 1]])) {
+            top--;
+        }
+        if (top == 0) {
+            for (uint32_t slot : shapes) drawSlot(slot, band);
+            return;
+        }
+
+        OcclusionScratch& scratch = occlusionScratch;
+        int rows = band.y1 - band.y0;
+        scratch.reset(rows);
+        int fullRows = 0;
+
+        for (size_t i = top; i-- > 0;) {
+            uint32_t slot = shapes[i];
+            const Placement& placement = placements[slot];
+            const Stamp& stamp = *placement.stamp;
+            int stampTop = placement.y + stamp.top;
+            int rowFirst = max(0, band.y0 - stampTop);
+            int rowLast = min((int)stamp.rows.size() - 1, band.y1 - stampTop);
+            auto clipped = [&](uint32_t k, int& x0, int& x1) {
+                x0 = max(placement.x + stamp.spans[k].x0, band.x0);
+                x1 = min(placement.x + stamp.spans[k].x1, band.x1);
+                return x0 < x1;
+            };
+
+            // First only measure how much is hidden; most shapes are either fully visible or fully hidden.
+            uint64_t total = 0;
+            uint64_t hidden = 0;
+            for (int r = rowFirst; r < rowLast; ++r) {
+                const vector<pair<int, int>>& covered = scratch.coverage[stampTop + r - band.y0];
+                for (uint32_t k = stamp.rows[r]; k < stamp.rows[r + 1]; ++k) {
+                    int x0, x1;
+                    if (!clipped(k, x0, x1)) continue;
+                    total += x1 - x0;
+                    if (fullRows == rows) {
+                        hidden += x1 - x0;
+                        continue;
+                    }
+                    for (auto c = scratch.firstCovering(covered, x0); c != covered.end() && c->first < x1; ++c) {
+                        hidden += min(x1, c->second) - max(x0, c->first);
+                    }
+                }
+            }
+
+            if (hidden == total) {
+                rasterTally.culledShapes++;
+                rasterTally.culledPixels += hidden;
+                continue;
+            }
+            rasterTally.culledPixels += hidden;
+            uint32_t first = scratch.pieces.size();
+            if (hidden > 0) {
+                for (int r = rowFirst; r < rowLast; ++r) {
+                    int y = stampTop + r;
+                    const vector<pair<int, int>>& covered = scratch.coverage[y - band.y0];
+                    for (uint32_t k = stamp.rows[r]; k < stamp.rows[r + 1]; ++k) {
+                        int x0, x1;
+                        if (!clipped(k, x0, x1)) continue;
+                        int x = x0;
+                        for (auto c = scratch.firstCovering(covered, x0); c != covered.end() && c->first < x1; ++c) {
+                            if (c->first > x) scratch.pieces.push_back({y, x, c->first});
+                            x = max(x, c->second);
+                        }
+                        if (x < x1) scratch.pieces.push_back({y, x, x1});
+                    }
+                }
+            }
+            scratch.ops.push_back({slot, first, (uint32_t)scratch.pieces.size()});
+
+            if (occludes(placement)) {
+                for (int r = rowFirst; r < rowLast; ++r) {
+                    vector<pair<int, int>>& covered = scratch.coverage[stampTop + r - band.y0];
+                    bool wasFull = covered.size() == 1 && covered[0].first <= band.x0 && covered[0].second >= band.x1;
+                    for (uint32_t k = stamp.rows[r]; k < stamp.rows[r + 1]; ++k) {
+                        int x0, x1;
+                        if (clipped(k, x0, x1) && x1 - x0 >= MIN_OCCLUDER_WIDTH) {
+                            OcclusionScratch::cover(covered, x0, x1);
+                        }
+                    }
+                    if (!wasFull && covered.size() == 1 && covered[0].first <= band.x0 && covered[0].second >= band.x1) {
+                        fullRows++;
+                    }
+                }
+            }
+        }
+
+        for (size_t i = scratch.ops.size(); i-- > 0;) {
+            const OcclusionScratch::Op& op = scratch.ops[i];
+            if (op.first == op.last) {
+                drawSlot(op.slot, band);
+                continue;
+            }
+            uint8_t color = placements[op.slot].color;
+            for (uint32_t k = op.first; k < op.last; ++k) {
+                const OcclusionScratch::Piece& piece = scratch.pieces[k];
+                grid.fillSpan(piece.y, piece.x0, piece.x1, color);
+                rasterTally.pixels += piece.x1 - piece.x0;
+            }
+            rasterTally.shapes++;
+        }
+        for (size_t i = top; i < shapes.size(); ++i) {
+            drawSlot(shapes[i], band);
+        }
+    }
+
+    void rasterizeBand(const Rect& band) {
+        grid.fill(band, BLANK_CELL);
+        // Big bands walk the store directly; small ones only touch the shapes the index finds.
+        vector<uint32_t> shapes;
+        if ((long long)(band.x1 - band.x0) * (band.y1 - band.y0) * 4 >= (long long)grid.getWidth() * grid.getHeight()) {
+            zorder.forEachInOrder([&](uint32_t slot) {
+                if (placements[slot].bounds.intersects(band)) {
+                    shapes.push_back(slot);
+                }
+            });
+        } else {
+            shapes = index.overlapping(band, store);
+        }
+
+        if (occlusionCulling) {
+            drawVisible(band, shapes);
+        } else {
+            for (uint32_t slot : shapes) {
+                drawSlot(slot, band);
+            }
+        }
+        metrics.pixelsRasterized += rasterTally.pixels;
+        metrics.shapesRasterized += rasterTally.shapes;
+        metrics.shapeDrawsCulled += rasterTally.culledShapes;
+        metrics.pixelsCulled += rasterTally.culledPixels;
+        rasterTally = RasterTally();
+    }
+
+    // Bands cover disjoint rows and each one paints its shapes in z order,
+    // so the parallel result matches the serial one exactly.
+    void rasterize(const Rect& region) {
+        long long cells = (long long)(region.x1 - region.x0) * (region.y1 - region.y0);
+        int rows = region.y1 - region.y0;
+        if (renderThreads <= 1 || cells < PARALLEL_MIN_CELLS || rows < 2) {
+            rasterizeBand(region);
+            return;
+        }
+
+        grid.own(region.y0, region.y1);
+        int bandCount = min(rows, renderThreads * BANDS_PER_THREAD);
+        atomic<int> nextBand(0);
+        auto worker = [&]() {
+            for (int band = nextBand++; band < bandCount; band = nextBand++) {
+                int top = region.y0 + (long long)rows * band / bandCount;
+                int bottom = region.y0 + (long long)rows * (band + 1) / bandCount;
+                rasterizeBand({region.x0, top, region.x1, bottom});
+            }
+        };
+
+        vector<thread> workers;
+        int threadCount = min(renderThreads, bandCount);
+        for (int i = 1; i < threadCount; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    void rebuildIndex() {
+        if (index.hasSize(grid.getWidth(), grid.getHeight())) {
+            index.clear();
+        } else {
+            index = SpatialIndex(grid.getWidth(), grid.getHeight());
+        }
+        for (uint32_t slot = 0; slot < store.end(); ++slot) {
+            if (store.alive(slot)) {
+                index.insert(slot, placements[slot].bounds);
+            }
+        }
+    }
+
+    uint32_t selectedSlot() const {
+        return store.find(selectedId);
+    }
+
+    void compactLogIfDue() {
+        if (changeLog && changeLog->wantsCompaction(store.size())) {
+            changeLog->compact(store, grid.getWidth(), grid.getHeight());
+        }
+    }
+
+    // Unjournaled primitives shared by the editing commands and by undo/redo. Each one also
+    // reports its effect to the change log, so undo and redo are logged like any edit.
+    void insertShape(int id, const ShapeData& shape, int64_t z) {
+        uint32_t slot = store.insert(id, shape, z);
+        zorder.insert(z, slot);
+        place(slot);
+        Rect bounds = placements[slot].bounds;
+        index.insert(slot, bounds);
+        markDirty(bounds);
+        if (changeLog) {
+            changeLog->put(id, shape, z);
+            compactLogIfDue();
+        }
+    }
+
+    void removeShape(int id) {
+        uint32_t slot = store.find(id);
+        Rect bounds = placements[slot].bounds;
+        index.remove(slot, bounds);
+        markDirty(bounds);
+        zorder.erase(store.zAt(slot));
+        store.erase(slot);
+        placements[slot] = Placement();
+        clippedStamps.erase(slot);
+        if (changeLog) {
+            changeLog->erase(id);
+            compactLogIfDue();
+        }
+    }
+
+    void setShape(int id, const ShapeData& shape, int64_t z) {
+        uint32_t slot = store.find(id);
+        Rect before = placements[slot].bounds;
+        index.remove(slot, before);
+        store.at(slot) = shape;
+        restack(slot, z);
+        place(slot);
+        Rect after = placements[slot].bounds;
+        index.insert(slot, after);
+        markDirty(before);
+        markDirty(after);
+        if (changeLog) {
+            changeLog->put(id, shape, z);
+            compactLogIfDue();
+        }
+    }
+
+    void restack(uint32_t slot, int64_t z) {
+        if (store.zAt(slot) == z) return;
+        zorder.erase(store.zAt(slot));
+        store.setZ(slot, z);
+        zorder.insert(z, slot);
+        markDirty(placements[slot].bounds);
+    }
+
+    void swapZ(int id, int otherId) {
+        uint32_t slot = store.find(id);
+        uint32_t other = store.find(otherId);
+        int64_t z = store.zAt(slot);
+        int64_t otherZ = store.zAt(other);
+        store.setZ(slot, otherZ);
+        store.setZ(other, z);
+        zorder.find(otherZ)->slot = slot;
+        zorder.find(z)->slot = other;
+        markDirty(placements[slot].bounds);
+        markDirty(placements[other].bounds);
+        if (changeLog) {
+            changeLog->setZ(id, otherZ);
+            changeLog->setZ(otherId, z);
+            compactLogIfDue();
+        }
+    }
+
+    void rasterizeDirty() {
+        ScopedTimer timer(metrics.phases["raster"]);
+        for (const Rect& region : dirty) {
+            rasterize(region);
+        }
+    }
+
+    void replaceStore(const ShapeStore& shapes) {
+        markAllShapesDirty();
+        store = shapes;
+        placements.assign(store.end(), Placement());
+        clippedStamps.clear();
+        vector<uint32_t> painted;
+        painted.reserve(store.size());
+        for (uint32_t slot = 0; slot < store.end(); ++slot) {
+            if (store.alive(slot)) {
+                painted.push_back(slot);
+                place(slot);
+            }
+        }
+        sort(painted.begin(), painted.end(), [&](uint32_t a, uint32_t b) { return store.zAt(a) < store.zAt(b); });
+        zorder.assignSorted(painted.size(), [&](size_t i) { return make_pair(store.zAt(painted[i]), painted[i]); });
+        rebuildIndex();
+        markAllShapesDirty();
+        if (changeLog) {
+            // A whole new board costs O(board) to log; the compaction it triggers folds it into a snapshot.
+            changeLog->clear();
+            for (uint32_t slot : painted) {
+                changeLog->put(store.idAt(slot), store.at(slot), store.zAt(slot));
+            }
+            compactLogIfDue();
+        }
+    }
+
+    void advanceCounters() {
+        for (uint32_t slot = 0; slot < store.end(); ++slot) {
+            if (store.alive(slot)) {
+                nextId = max(nextId, store.idAt(slot) + 1);
+                nextZ = max(nextZ, store.zAt(slot) + 1);
+            }
+        }
+    }
+
+    void markAllShapesDirty() {
+        for (uint32_t slot = 0; slot < store.end(); ++slot) {
+            if (store.alive(slot)) {
+                markDirty(shapeBounds(store.at(slot)));
+            }
+        }
+    }
+
+    void apply(const JournalEntry& entry, bool forward) {
+        switch (entry.kind) {
+            case JournalEntry::Add:
+                forward ? insertShape(entry.id, *entry.after, entry.zAfter) : removeShape(entry.id);
+                break;
+            case JournalEntry::Remove:
+                forward ? removeShape(entry.id) : insertShape(entry.id, *entry.before, entry.zBefore);
+                break;
+            case JournalEntry::Modify:
+                setShape(entry.id, forward ? *entry.after : *entry.before, forward ? entry.zAfter : entry.zBefore);
+                break;
+            case JournalEntry::Replace:
+                replaceStore(forward ? *entry.storeAfter : *entry.storeBefore);
+                break;
+            case JournalEntry::Swap:
+                swapZ(entry.id, entry.otherId);
+                break;
+            case JournalEntry::Batch:
+                if (forward) {
+                    for (const JournalEntry& part : *entry.parts) {
+                        apply(part, true);
+                    }
+                } else {
+                    for (auto part = entry.parts->rbegin(); part != entry.parts->rend(); ++part) {
+                        apply(*part, false);
+                    }
+                }
+                break;
+        }
+    }
+
+    void seek(size_t target) {
+        size_t position = journal.position();
+        size_t steps = position > target ? position - target : target - position;
+        auto [snapshotAt, snapshot] = journal.snapshotAtOrBefore(target);
+        if (snapshot && snapshotAt >= journal.first() && snapshot->size() / SNAPSHOT_COPY_RATIO + (target - snapshotAt) < steps) {
+            replaceStore(*snapshot);
+            position = snapshotAt;
+        }
+        while (position > target) {
+            apply(journal.at(--position), false);
+        }
+        while (position < target) {
+            apply(journal.at(position++), true);
+        }
+        journal.setPosition(target);
+    }
+
+    void record(JournalEntry entry) {
+        journal.record(move(entry), store);
+    }
+
+    void recordBatch(vector<JournalEntry>&& parts) {
+        if (parts.empty()) return;
+        record(JournalEntry::batch(move(parts)));
+    }
+
+    // Slots of the region shapes that still exist, in paint order.
+    vector<uint32_t> regionSlots() const {
+        vector<uint32_t> slots;
+        slots.reserve(region.size());
+        for (int id : region) {
+            uint32_t slot = store.find(id);
+            if (slot != NO_SLOT) slots.push_back(slot);
+        }
+        sort(slots.begin(), slots.end(), [&](uint32_t a, uint32_t b) { return store.zAt(a) < store.zAt(b); });
+        return slots;
+    }
+
+public:
+    Board(int width, int height) : grid(width, height), index(width, height) {}
+
+    int getWidth() const {
+        return grid.getWidth();
+    }
+
+    int getHeight() const {
+        return grid.getHeight();
+    }
+
+    template <typename F>
+    void forEachShape(F&& f) {
+        zorder.forEachInOrder([&](uint32_t slot) { f(store.idAt(slot), store.at(slot)); });
+    }
+
+    void drawBoard() {
+        rasterizeDirty();
+        if (presenter.running()) {
+            presenter.publish(grid, dirty);
+        } else if (composer.canUpdate()) {
+            composer.composeUpdates(grid, dirty);
+        } else {
+            composer.compose(grid);
+        }
+        dirty.clear();
+        collectFrameStats();
+    }
+
+    bool exportImage(ostream& out, int scale, int samples, bool gray) {
+        rasterizeDirty();
+        ImageExporter exporter(store, index, grid, scale, samples, renderThreads, gray);
+        return exporter.write(out);
+    }
+
+    size_t getLastFrameBytes() const {
+        return composer.getLastFrameBytes();
+    }
+
+    // Renders pending changes into a copy readers can keep while the board changes. The shapes
+    // and their index are copied, O(shapes); the canvas shares its row blocks, so later edits
+    // copy only the blocks they repaint. The changed regions are not kept, so this board's own
+    // next frame is sent whole.
+    shared_ptr<const BoardSnapshot> snapshot(uint64_t version) {
+        rasterizeDirty();
+        if (!dirty.empty()) {
+            composer.forgetShown();
+            dirty.clear();
+        }
+        return make_shared<const BoardSnapshot>(BoardSnapshot{version, store, zorder, index, grid.share()});
+    }
+
+    // True while live frames are written in the background; drawBoard then only queues them.
+    bool presentsAsync() const {
+        return presenter.running();
+    }
+
+    void collectFrameStats() {
+        presenter.drainInto(metrics);
+        if (!presenter.running()) {
+            composer.getTally().drainInto(metrics);
+        }
+    }
+
+    // Waits for queued frames to reach the terminal.
+    void finishFrames() {
+        bool wasRunning = presenter.running();
+        presenter.stop();
+        collectFrameStats();
+        if (wasRunning) {
+            presenter.start();
+        }
+    }
+
+    // Forces the next drawBoard to rasterize and send the whole board.
+    void invalidate() {
+        markDirty(boardRect());
+    }
+
+    void setFrameOutput(int fd) {
+        composer.setOutput(fd);
+    }
+
+    bool setLiveMode(bool on) {
+        presenter.stop();
+        bool done = composer.setAnchored(on, grid.getHeight() + 2);
+        if (on && done) {
+            presenter.start();
+        }
+        collectFrameStats();
+        return done;
+    }
+
+    void setRenderThreads(int count) {
+        renderThreads = count;
+    }
+
+    int getRenderThreads() const {
+        return renderThreads;
+    }
+
+    void setOcclusionCulling(bool on) {
+        occlusionCulling = on;
+        invalidate();
+    }
+
+    bool getOcclusionCulling() const {
+        return occlusionCulling;
+    }
+
+    void resize(int width, int height) {
+        if (changeLog) {
+            changeLog->resize(width, height);
+        }
+        grid = Canvas(width, height);
+        vector<uint32_t> oversized;
+        for (const auto& entry : clippedStamps) {
+            oversized.push_back(entry.first);
+        }
+        for (uint32_t slot : oversized) {
+            place(slot);
+        }
+        rebuildIndex();
+        dirty.clear();
+        markDirty(boardRect());
+        presenter.stop();
+        if (composer.isAnchored() && !composer.setAnchored(true, height + 2)) {
+            composer.setAnchored(false, 0);
+        }
+        if (composer.isAnchored()) {
+            presenter.start();
+        }
+        collectFrameStats();
+    }
+
+    int allocateId() {
+        return nextId++;
+    }
+
+    bool hasId(int id) const {
+        return store.find(id) != NO_SLOT;
+    }
+
+    void addShape(int id, const ShapeData& shape) {
+        int64_t z = nextZ++;
+        nextId = max(nextId, id + 1);
+        insertShape(id, shape, z);
+        record(JournalEntry::add(id, z, shape));
+    }
+
+    // Swaps in a freshly loaded set of shapes as a single undoable step.
+    void replaceShapes(ShapeStore&& shapes) {
+        auto before = make_shared<const ShapeStore>(store);
+        auto after = make_shared<const ShapeStore>(move(shapes));
+        replaceStore(*after);
+        advanceCounters();
+        record(JournalEntry::replace(before, after));
+    }
+
+    // Installs shapes recovered from the change log; unlike a load, there is nothing to undo.
+    void restoreShapes(ShapeStore&& shapes) {
+        replaceStore(shapes);
+        advanceCounters();
+    }
+
+    size_t shapeCount() const {
+        return store.size();
+    }
+
+    // Logs every change from now on, starting from a snapshot of the current board.
+    void setChangeLog(WriteAheadLog* log) {
+        changeLog = log;
+        if (changeLog) {
+            changeLog->start(store, grid.getWidth(), grid.getHeight());
+        }
+    }
+
+    // Returns once the changes made so far are on disk; call it without holding the board.
+    bool awaitDurable() {
+        return !changeLog || changeLog->waitDurable();
+    }
+
+    // After a failed log write the board stays readable but takes no more edits.
+    bool readOnly() const {
+        return changeLog && changeLog->hasFailed();
+    }
+
+    void selectByCoord(int x, int y) {
+        uint32_t slot = index.topmostAt(x, y, store);
+        if (slot != NO_SLOT) {
+            selectedId = store.idAt(slot);
+            region.clear();
+            *console.output << "Shape selected: " << describeSelected() << endl;
+            return;
+        }
+        *console.output << "No shape found." << endl;
+    }
+
+    void selectById(const string& text) {
+        int id;
+        if (parseShapeId(text, id) && store.find(id) != NO_SLOT) {
+            selectedId = id;
+            region.clear();
+            *console.output << "Shape selected: " << describeSelected() << endl;
+        }
+        else {
+            *console.error << "Shape not found." << endl;
+        }
+    }
+
+    int getSelectedId() const {
+        return selectedId;
+    }
+
+    // Restores a selection saved earlier; an id that is gone simply selects nothing.
+    void setSelectedId(int id) {
+        selectedId = id;
+    }
+
+    bool hasSelection() const {
+        return selectedSlot() != NO_SLOT;
+    }
+
+    // Selects every shape whose bounds overlap the area, replacing the single selection.
+    size_t selectRect(const Rect& area) {
+        selectedId = 0;
+        region.clear();
+        for (uint32_t slot : index.overlapping(area, store)) {
+            region.push_back(store.idAt(slot));
+        }
+        return region.size();
+    }
+
+    bool hasRegion() const {
+        return !region.empty();
+    }
+
+    // Lets the server keep one region per client.
+    void swapRegion(vector<int>& other) {
+        region.swap(other);
+    }
+
+    string describeSelected() const {
+        return describeShape(selectedId, store.at(selectedSlot()));
+    }
+
+    void removeSelectedShape() {
+        uint32_t slot = selectedSlot();
+        if (slot != NO_SLOT) {
+            string description = describeSelected();
+            JournalEntry entry = JournalEntry::remove(selectedId, store.zAt(slot), store.at(slot));
+            removeShape(selectedId);
+            record(move(entry));
+            *console.info << shapeIdName(selectedId) << " " << description << " removed" << endl;
+            selectedId = 0;
+        } else {
+            *console.error << " No shape selected to remove." << endl;
+        }
+    }
+
+    // A moved shape is also raised to the top of the paint order.
+    bool moveSelected(int newX, int newY) {
+        uint32_t slot = selectedSlot();
+        ShapeData shape = store.at(slot);
+        if (!visit([&](auto& s) { return s.move(newX, newY, grid.getWidth(), grid.getHeight()); }, shape)) {
+            return false;
+        }
+        int64_t z = nextZ++;
+        JournalEntry entry = JournalEntry::modify(selectedId, store.zAt(slot), z, store.at(slot), shape);
+        setShape(selectedId, shape, z);
+        record(move(entry));
+        return true;
+    }
+
+    bool editSelected(const vector<int>& params) {
+        uint32_t slot = selectedSlot();
+        ShapeData shape = store.at(slot);
+        if (!visit([&](auto& s) { return s.edit(params, grid.getWidth(), grid.getHeight()); }, shape)) {
+            return false;
+        }
+        JournalEntry entry = JournalEntry::modify(selectedId, store.zAt(slot), store.zAt(slot), store.at(slot), shape);
+        setShape(selectedId, shape, store.zAt(slot));
+        record(move(entry));
+        return true;
+    }
+
+    enum class Restack { Raise, Lower, Front, Back };
+
+    // Changes where the selected shape sits in the paint order; false when it is already there.
+    bool restackSelected(Restack how) {
+        uint32_t slot = selectedSlot();
+        int64_t z = store.zAt(slot);
+        bool upwards = how == Restack::Raise || how == Restack::Front;
+        const ZOrder::Node* neighbor = zorder.neighbor(z, upwards);
+        if (!neighbor) return false;
+
+        if (how == Restack::Raise || how == Restack::Lower) {
+            int otherId = store.idAt(neighbor->slot);
+            int64_t otherZ = neighbor->z;
+            swapZ(selectedId, otherId);
+            record(JournalEntry::swap(selectedId, z, otherId, otherZ));
+            return true;
+        }
+
+        int64_t newZ = upwards ? nextZ++ : zorder.lowest()->z - 1;
+        JournalEntry entry = JournalEntry::modify(selectedId, z, newZ, store.at(slot), store.at(slot));
+        setShape(selectedId, *entry.after, newZ);
+        record(move(entry));
+        return true;
+    }
+
+    // Each region command below is one journal entry, so a single undo reverts the whole batch;
+    // the shapes it touches are redrawn together on the next draw.
+    size_t paintRegion(char color) {
+        vector<JournalEntry> parts;
+        for (uint32_t slot : regionSlots()) {
+            int id = store.idAt(slot);
+            ShapeData shape = store.at(slot);
+            visit([&](auto& s) { s.paint(color); }, shape);
+            parts.push_back(JournalEntry::modify(id, store.zAt(slot), store.zAt(slot), store.at(slot), shape));
+            setShape(id, shape, store.zAt(slot));
+        }
+        size_t painted = parts.size();
+        recordBatch(move(parts));
+        return painted;
+    }
+
+    // Shifts the region by an offset and raises it to the top, keeping its own paint order.
+    // The region moves as a whole or not at all, so a layout never comes apart at the edges.
+    optional<size_t> moveRegion(int dx, int dy) {
+        vector<uint32_t> slots = regionSlots();
+        vector<ShapeData> moved;
+        moved.reserve(slots.size());
+        size_t blocked = 0;
+        for (uint32_t slot : slots) {
+            ShapeData shape = store.at(slot);
+            ShapeRecord at = makeRecord(0, shape);
+            if (!visit([&](auto& s) { return s.move(at.x + dx, at.y + dy, grid.getWidth(), grid.getHeight(), true); }, shape)) {
+                blocked++;
+            }
+            moved.push_back(shape);
+        }
+        if (blocked > 0) {
+            *console.error << "error: " << blocked << " of " << slots.size() << " shapes will go out of the board" << endl;
+            return nullopt;
+        }
+
+        vector<JournalEntry> parts;
+        parts.reserve(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i) {
+            int id = store.idAt(slots[i]);
+            int64_t z = nextZ++;
+            parts.push_back(JournalEntry::modify(id, store.zAt(slots[i]), z, store.at(slots[i]), moved[i]));
+            setShape(id, moved[i], z);
+        }
+        recordBatch(move(parts));
+        return slots.size();
+    }
+
+    // Edits the region shapes that accept the parameters and skips the rest, since a region
+    // usually mixes kinds that take different parameters. Returns {edited, skipped}.
+    pair<size_t, size_t> editRegion(const vector<int>& params) {
+        vector<JournalEntry> parts;
+        size_t skipped = 0;
+        for (uint32_t slot : regionSlots()) {
+            ShapeData shape = store.at(slot);
+            if (!visit([&](auto& s) { return s.edit(params, grid.getWidth(), grid.getHeight(), true); }, shape)) {
+                skipped++;
+                continue;
+            }
+            int id = store.idAt(slot);
+            parts.push_back(JournalEntry::modify(id, store.zAt(slot), store.zAt(slot), store.at(slot), shape));
+            setShape(id, shape, store.zAt(slot));
+        }
+        size_t edited = parts.size();
+        recordBatch(move(parts));
+        return {edited, skipped};
+    }
+
+    size_t removeRegion() {
+        vector<JournalEntry> parts;
+        for (uint32_t slot : regionSlots()) {
+            int id = store.idAt(slot);
+            parts.push_back(JournalEntry::remove(id, store.zAt(slot), store.at(slot)));
+            removeShape(id);
+        }
+        region.clear();
+        size_t removed = parts.size();
+        recordBatch(move(parts));
+        return removed;
+    }
+
+    void paintSelected(char color) {
+        uint32_t slot = selectedSlot();
+        ShapeData shape = store.at(slot);
+        visit([&](auto& s) { s.paint(color); }, shape);
+        JournalEntry entry = JournalEntry::modify(selectedId, store.zAt(slot), store.zAt(slot), store.at(slot), shape);
+        setShape(selectedId, shape, store.zAt(slot));
+        record(move(entry));
+    }
+
+    size_t undo(size_t steps) {
+        size_t done = min(steps, journal.position() - journal.first());
+        seek(journal.position() - done);
+        return done;
+    }
+
+    size_t redo(size_t steps) {
+        size_t done = min(steps, journal.last() - journal.position());
+        seek(journal.position() + done);
+        return done;
+    }
+
+    void clear() {
+        // Nothing here walks the shapes: the old store moves into the journal and every
+        // derived structure is pooled, so clearing costs the same for any board.
+        auto before = make_shared<const ShapeStore>(move(store));
+        auto after = make_shared<const ShapeStore>();
+        store = ShapeStore();
+        invalidate();
+        index.clear();
+        placements.clear();
+        clippedStamps.clear();
+        zorder.clear();
+        selectedId = 0;
+        region.clear();
+        if (changeLog) {
+            changeLog->clear();
+        }
+        record(JournalEntry::replace(before, after));
+    }
+};
+
+void saveText(Board& board, const string &filename) {
+    ofstream outFile(filename);
+    if (outFile.is_open()) {
+        board.forEachShape([&](int id, const ShapeData& shape) {
+            outFile << describeShape(id, shape) << '\n';
+        });
+        metrics.fileBytesWritten += outFile.tellp();
+        outFile.close();
+        *console.info << "Board saved to " << filename << endl;
+    } else {
+        *console.error << "Error opening file for saving." << endl;
+    }
+}
+
+bool hasSuffix(const string& filename, const string& suffix) {
+    return filename.size() > suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool isBinaryName(const string& filename) {
+    return hasSuffix(filename, ".bin");
+}
+
+void saveBinary(Board& board, const string &filename) {
+    vector<ShapeRecord> records;
+    board.forEachShape([&](int id, const ShapeData& shape) {
+        records.push_back(makeRecord(id, shape));
+    });
+
+    BoardFileHeader header{};
+    memcpy(header.magic, BOARD_FILE_MAGIC, sizeof(header.magic));
+    header.version = BOARD_FILE_VERSION;
+    header.recordSize = sizeof(ShapeRecord);
+    header.count = records.size();
+    header.width = board.getWidth();
+    header.height = board.getHeight();
+    header.checksum = boardChecksum(records.data(), records.size() * sizeof(ShapeRecord));
+
+    ofstream outFile(filename, ios::binary);
+    if (!outFile.is_open()) {
+        *console.error << "Error opening file for saving." << endl;
+        return;
+    }
+    outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    outFile.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ShapeRecord));
+    if (outFile.good()) {
+        metrics.fileBytesWritten += sizeof(header) + records.size() * sizeof(ShapeRecord);
+        *console.info << "Board saved to " << filename << endl;
+    } else {
+        *console.error << "Error writing " << filename << endl;
+    }
+}
+
+// Names ending in .pgm get a grayscale PGM, anything else a color PPM.
+void exportImage(Board& board, const string &filename, int scale, int samples) {
+    if ((long long)board.getWidth() * scale > MAX_EXPORT_SIDE || (long long)board.getHeight() * scale > MAX_EXPORT_SIDE) {
+        *console.error << "Image too large, sides are limited to " << MAX_EXPORT_SIDE << " pixels." << endl;
+        return;
+    }
+    ofstream outFile(filename, ios::binary);
+    if (!outFile.is_open()) {
+        *console.error << "Error opening file for export." << endl;
+        return;
+    }
+    ScopedTimer timer(metrics.phases["export"]);
+    if (board.exportImage(outFile, scale, samples, hasSuffix(filename, ".pgm"))) {
+        metrics.fileBytesWritten += outFile.tellp();
+        *console.info << "Board exported to " << filename << endl;
+    } else {
+        *console.error << "Error writing " << filename << endl;
+    }
+}
+
+// Returns false when the file is not in the binary format, so the caller can fall back to text.
+bool loadBinary(Board& board, const string &filename) {
+    MappedFile file(filename);
+    if (!file.isOpen() || file.length() < sizeof(BoardFileHeader) ||
+        memcmp(file.bytes(), BOARD_FILE_MAGIC, sizeof(BOARD_FILE_MAGIC)) != 0) {
+        return false;
+    }
+
+    BoardFileHeader header;
+    memcpy(&header, file.bytes(), sizeof(header));
+    size_t tableSize = header.count * sizeof(ShapeRecord);
+    if (header.version != BOARD_FILE_VERSION || header.recordSize != sizeof(ShapeRecord) ||
+        header.count > (file.length() - sizeof(header)) / sizeof(ShapeRecord) ||
+        file.length() != sizeof(header) + tableSize || !validBoardSize(header.width, header.height)) {
+        *console.error << "Unsupported or truncated board file: " << filename << endl;
+        return true;
+    }
+
+    const char* table = file.bytes() + sizeof(header);
+    if (boardChecksum(table, tableSize) != header.checksum) {
+        *console.error << "Checksum mismatch in " << filename << endl;
+        return true;
+    }
+
+    ShapeStore loaded;
+    loaded.reserve(header.count);
+    const ShapeRecord* records = reinterpret_cast<const ShapeRecord*>(table);
+    for (size_t i = 0; i < header.count; ++i) {
+        optional<ShapeData> shape = shapeFromRecord(records[i]);
+        if (!shape || records[i].id <= 0 || loaded.find(records[i].id) != NO_SLOT) {
+            *console.error << "Invalid shape record " << i << " in " << filename << endl;
+            continue;
+        }
+        loaded.insert(records[i].id, *shape, i);
+    }
+    if (header.width != board.getWidth() || header.height != board.getHeight()) {
+        board.resize(header.width, header.height);
+    }
+    board.replaceShapes(move(loaded));
+    metrics.fileBytesRead += file.length();
+    *console.info << "Board loaded from " << filename << endl;
+    return true;
+}
+
+void loadText(Board& board, const string &filename) {
+    ifstream inFile(filename, ios::binary);
+    if (!inFile.is_open()) {
+        *console.error << "Error opening file for loading." << endl;
+        return;
+    }
+
+    ShapeStore loaded;
+    size_t reserved = 0;
+    vector<char> block;
+    size_t carried = 0;
+    size_t firstLine = 1;
+    while (true) {
+        block.resize(carried + LOAD_BLOCK_SIZE);
+        inFile.read(block.data() + carried, LOAD_BLOCK_SIZE);
+        metrics.fileBytesRead += inFile.gcount();
+        size_t filled = carried + inFile.gcount();
+        bool atEnd = inFile.gcount() == 0;
+
+        // Only whole lines are parsed; a partial last line waits for the next block.
+        const char* begin = block.data();
+        const char* end = begin + filled;
+        if (!atEnd) {
+            while (end > begin && end[-1] != '\n') --end;
+            if (end == begin) end = begin + filled;
+        }
+
+        vector<ParsedChunk> chunks = parseText(begin, end);
+        size_t needed = loaded.size();
+        for (const ParsedChunk& chunk : chunks) needed += chunk.shapes.size();
+        if (needed > reserved) {
+            reserved = max(needed, reserved * 2);
+            loaded.reserve(reserved);
+        }
+        for (ParsedChunk& chunk : chunks) {
+            vector<ParseError>& errors = chunk.errors;
+            for (const ParsedShape& parsed : chunk.shapes) {
+                if (loaded.find(parsed.id) != NO_SLOT) {
+                    errors.push_back({parsed.line, "Invalid or duplicate shape id: " + shapeIdName(parsed.id)});
+                } else {
+                    loaded.insert(parsed.id, parsed.shape, loaded.size());
+                }
+            }
+            sort(errors.begin(), errors.end(), [](const ParseError& a, const ParseError& b) { return a.line < b.line; });
+            for (const ParseError& error : errors) {
+                *console.error << "Line " << firstLine + error.line << ": " << error.message << endl;
+            }
+            firstLine += chunk.lines;
+        }
+
+        carried = block.data() + filled - end;
+        memmove(block.data(), end, carried);
+        if (atEnd) break;
+    }
+    board.replaceShapes(move(loaded));
+    *console.info << "Board loaded from " << filename << endl;
+}
+
+class UserInterface {
+private:
+    Board board;
+
+public:
+    UserInterface(int width, int height, int threads) : board(width, height) {
+        board.setRenderThreads(threads);
+    }
+
+    // Runs commands until `exit` or end of input and returns how many were executed.
+    size_t run(istream& in) {
+        string command;
+        stringstream ss;
+        size_t executed = 0;
+        *console.info << """Welcome to the Shapes Blackboard. Choose the command from the list:\n"
+                "1. draw\n"
+                "2. list\n"
+                "3. shapes\n"
+                "4. add\n"
+                "5. undo\n"
+                "6. redo\n"
+                "7. clear\n"
+                "8. save\n"
+                "9. load\n"
+                "10. select\n"
+                "11. remove\n"
+                "12. edit\n"
+                "13. paint\n"
+                "14. move\n"
+                "15. live\n"
+                "16. resize\n"
+                "17. threads\n"
+                "18. stats\n"
+                "19. cull\n"
+                "20. raise\n"
+                "21. lower\n"
+                "22. front\n"
+                "23. back\n"
+                "24. export\n"
+                "25. exit\n""" << endl;
+
+        while (true) {
+            *console.info << ">";
+            if (!getline(in, command)) {
+                board.finishFrames();
+                return executed;
+            }
+
+            ss.clear();
+            ss.str(command);
+            string cmd;
+            if (!(ss >> cmd) || cmd[0] == '#') {
+                continue;
+            }
+            executed++;
+
+            uint64_t start = nowNs();
+            bool mutating = mutates(cmd) && !board.readOnly();
+            bool keepGoing = execute(cmd, ss);
+            if (mutating && !board.awaitDurable()) {
+                *console.error << UNSAVED_CHANGE_ERROR << endl;
+            }
+            metrics.commands[cmd].add(nowNs() - start);
+            if (!keepGoing) {
+                board.finishFrames();
+                return executed;
+            }
+        }
+    }
+
+    Board& getBoard() {
+        return board;
+    }
+
+    // Commands that change the board; with a change log they are answered only once it is on disk.
+    static bool mutates(const string& cmd) {
+        static const char* const names[] = {"add", "undo", "redo", "clear", "load", "remove", "edit",
+                                            "paint", "move", "resize", "raise", "lower", "front", "back"};
+        return any_of(begin(names), end(names), [&](const char* name) { return cmd == name; });
+    }
+
+    // Runs one command; returns false on `exit`. Unknown commands are renamed so they share one histogram.
+    bool execute(string& cmd, stringstream& ss) {
+        if (board.readOnly() && mutates(cmd)) {
+            *console.error << "error: the write-ahead log failed, the board is read-only" << endl;
+            return true;
+        }
+        if (cmd == "draw") {
+            drawBoard();
+        } else if (cmd == "list") {
+            listOfShapes();
+        } else if (cmd == "shapes") {
+            availableShapes();
+        } else if (cmd == "add") {
+            add(ss);
+        } else if (cmd == "undo") {
+            undo(ss);
+        } else if (cmd == "redo") {
+            redo(ss);
+        } else if (cmd == "clear") {
+            clear();
+        } else if (cmd == "save") {
+            string filename, format;
+            ss >> filename >> format;
+            if (format == "binary" || (format.empty() && isBinaryName(filename))) {
+                saveBinary(board, filename);
+            } else {
+                saveText(board, filename);
+            }
+        } else if (cmd == "load") {
+            string filename;
+            ss >> filename;
+            if (!loadBinary(board, filename)) {
+                loadText(board, filename);
+            }
+        } else if (cmd == "select") {
+            select(ss);
+        } else if (cmd == "remove") {
+            remove();
+        } else if (cmd == "edit") {
+            edit(ss);
+        } else if (cmd == "paint") {
+            paint(ss);
+        } else if (cmd == "move") {
+            move(ss);
+        } else if (cmd == "live") {
+            string mode;
+            ss >> mode;
+            live(mode);
+        } else if (cmd == "resize") {
+            resize(ss);
+        } else if (cmd == "threads") {
+            threads(ss);
+        } else if (cmd == "stats") {
+            stats(ss);
+        } else if (cmd == "raise") {
+            restack(Board::Restack::Raise, "raised", "already on top");
+        } else if (cmd == "lower") {
+            restack(Board::Restack::Lower, "lowered", "already at the bottom");
+        } else if (cmd == "front") {
+            restack(Board::Restack::Front, "brought to front", "already on top");
+        } else if (cmd == "back") {
+            restack(Board::Restack::Back, "sent to back", "already at the bottom");
+        } else if (cmd == "cull") {
+            string mode;
+            ss >> mode;
+            cull(mode);
+        } else if (cmd == "export") {
+            exportBoard(ss);
+        } else if (cmd == "exit") {
+            return false;
+        } else {
+            *console.error << "Invalid command!" << endl;
+            cmd = "invalid";
+        }
+        return true;
+    }
+
+private:
     void drawBoard() {
         board.drawBoard();
+        if (board.presentsAsync()) {
+            *console.info << "Frame queued." << endl;
+        } else {
+            *console.info << "Frame: " << board.getLastFrameBytes() << " bytes" << endl;
+        }
     }
 
     void listOfShapes() {
-        cout << "List of shapes:" << endl;
-        for (const auto &shape: board.getShapes()) {
-            cout << shape->getDescription() << endl;
-        }
+        *console.output << "List of shapes:" << endl;
+        board.forEachShape([](int id, const ShapeData& shape) {
+            *console.output << describeShape(id, shape) << endl;
+        });
     }
 
     void availableShapes() {
-        cout << "Available shapes:\n";
-        cout << "1. Triangle - Parameters: x y height\n";
-        cout << "2. Circle - Parameters: x y radius\n";
-        cout << "3. Rectangle - Parameters: x y width height\n";
-        cout << "4. Square - Parameters: x y sideLength\n";
+        *console.output << "Available shapes:\n";
+        *console.output << "1. Triangle - Parameters: x y height\n";
+        *console.output << "2. Circle - Parameters: x y radius\n";
+        *console.output << "3. Rectangle - Parameters: x y width height\n";
+        *console.output << "4. Square - Parameters: x y sideLength\n";
     }
 
     void add(stringstream &ss) {
         string fillType, color, shapeType;
-        static int shapeCounter = 1;
         ss >> fillType >> color >> shapeType;
 
+        if (!isColor(color)) {
+            *console.error << "Unknown color: " << color << endl;
+            return;
+        }
         char colorChar = color[0];
         bool fill = (fillType == "fill");
-        string id = "Shape" + to_string(shapeCounter++);
+        int id = board.allocateId();
         bool isDuplicate = false;
 
         if (shapeType == "triangle") {
             int x, y, height;
-            ss >> x >> y >> height;
+            if (!readInts(ss, x, y, height)) {
+                *console.error << "Invalid shape parameters!" << endl;
+                return;
+            }
 
             if (!isDuplicate) {
-                auto triangle = make_shared<Triangle>(id, colorChar, fill, x, y, height);
-                board.addShape(triangle);
-                cout << id << " triangle " << color << " " << height << " " << x << " " << y << endl;
+                board.addShape(id, Triangle(colorChar, fill, x, y, height));
+                *console.info << shapeIdName(id) << " triangle " << color << " " << height << " " << x << " " << y << endl;
             }
         } else if (shapeType == "circle") {
             int x, y, radius;
-            ss >> x >> y >> radius;
+            if (!readInts(ss, x, y, radius)) {
+                *console.error << "Invalid shape parameters!" << endl;
+                return;
+            }
 
             if (!isDuplicate) {
-                auto circle = make_shared<Circle>(id, colorChar, fill, x, y, radius);
-                board.addShape(circle);
-                cout << id << " circle " << color << " " << radius << " " << x << " " << y << endl;
+                board.addShape(id, Circle(colorChar, fill, x, y, radius));
+                *console.info << shapeIdName(id) << " circle " << color << " " << radius << " " << x << " " << y << endl;
             }
         } else if (shapeType == "rectangle") {
             int x, y, width, height;
-            ss >> x >> y >> width >> height;
+            if (!readInts(ss, x, y, width, height)) {
+                *console.error << "Invalid shape parameters!" << endl;
+                return;
+            }
 
             if (!isDuplicate) {
-                auto rectangle = make_shared<Rectangle>(id, colorChar, fill, x, y, width, height);
-                board.addShape(rectangle);
-                cout << id << " rectangle " << color << " " << width << " " << height << " " << x << " " << y << endl;
+                board.addShape(id, Rectangle(colorChar, fill, x, y, width, height));
+                *console.info << shapeIdName(id) << " rectangle " << color << " " << width << " " << height << " " << x << " " << y << endl;
             }
         } else if (shapeType == "square") {
             int x, y, sideLength;
-            ss >> x >> y >> sideLength;
+            if (!readInts(ss, x, y, sideLength)) {
+                *console.error << "Invalid shape parameters!" << endl;
+                return;
+            }
 
             if (!isDuplicate) {
-                auto square = make_shared<Square>(id, colorChar, fill, x, y, sideLength);
-                board.addShape(square);
-                cout << id << " square " << color << " " << sideLength << " " << x << " " << y << endl;
+                board.addShape(id, Square(colorChar, fill, x, y, sideLength));
+                *console.info << shapeIdName(id) << " square " << color << " " << sideLength << " " << x << " " << y << endl;
             }
         } else {
-            cout << "Invalid shape type!" << endl;
-        }
-    }
-
-    void undo() {
-        if (!board.getShapes().empty()) {
-            board.getShapes().pop_back();
-            cout << "Last added shape removed." << endl;
-        } else {
-            cout << "No shapes to undo." << endl;
+            *console.error << "Invalid shape type!" << endl;
         }
     }
 
-    void clear() {
-        board.getShapes().clear();
-        cout << "Board cleared." << endl;
+    static size_t stepCount(stringstream &ss) {
+        long long steps;
+        if (!(ss >> steps)) return 1;
+        return steps > 0 ? (size_t)steps : 0;
     }
 
-    void save(const string &filename) {
-        ofstream outFile(filename);
-        if (outFile.is_open()) {
-            for (const auto &shape: board.getShapes()) {
-                outFile << shape->getDescription() << endl;
-            }
-            outFile.close();
-            cout << "Board saved to " << filename << endl;
+    void undo(stringstream &ss) {
+        size_t done = board.undo(stepCount(ss));
+        if (done > 0) {
+            *console.info << "Undone " << done << " operation(s)." << endl;
         } else {
-            cout << "Error opening file for saving." << endl;
+            *console.info << "Nothing to undo." << endl;
         }
     }
 
-    void load(const string &filename) {
-        ifstream inFile(filename);
-        if (inFile.is_open()) {
-            board.getShapes().clear();
-            string line;
-
-            while (getline(inFile, line)) {
-                istringstream iss(line);
-                string shapeType, id, color;
-                bool fill;
-                int x, y, size1, size2;
-
-                iss >> id >> shapeType >> color >> fill;
-
-                if (shapeType == "triangle") {
-                    iss >> x >> y >> size1;
-                    if (!iss.fail()) {
-                        auto triangle = make_shared<Triangle>(id, color[0], fill, x, y, size1);
-                        board.addShape(triangle);
-                    } else {
-                        cout << "Error parsing triangle: " << line << endl;
-                    }
-                } else if (shapeType == "circle") {
-                    iss >> x >> y >> size1;
-                    if (!iss.fail()) {
-                        auto circle = make_shared<Circle>(id, color[0], fill, x, y, size1);
-                        board.addShape(circle);
-                    } else {
-                        cout << "Error parsing circle: " << line << endl;
-                    }
-                } else if (shapeType == "rectangle") {
-                    iss >> x >> y >> size1 >> size2;
-                    if (!iss.fail()) {
-                        auto rectangle = make_shared<Rectangle>(id, color[0], fill, x, y, size1, size2);
-                        board.addShape(rectangle);
-                    } else {
-                        cout << "Error parsing rectangle: " << line << endl;
-                    }
-                } else if (shapeType == "square") {
-                    iss >> x >> y >> size1;
-                    if (!iss.fail()) {
-                        auto square = make_shared<Square>(id, color[0], fill, x, y, size1);
-                        board.addShape(square);
-                    } else {
-                        cout << "Error parsing square: " << line << endl;
-                    }
-                } else {
-                    cout << "Unknown shape type: " << shapeType << endl;
-                }
-            }
-
-            inFile.close();
-            cout << "Board loaded from " << filename << endl;
+    void redo(stringstream &ss) {
+        size_t done = board.redo(stepCount(ss));
+        if (done > 0) {
+            *console.info << "Redone " << done << " operation(s)." << endl;
         } else {
-            cout << "Error opening file for loading." << endl;
+            *console.info << "Nothing to redo." << endl;
         }
     }
 
+    void clear() {
+        board.clear();
+        *console.info << "Board cleared." << endl;
+    }
+
     void select(stringstream &ss) {
         string idOrCoord;
         ss >> idOrCoord;
-        if (isdigit(idOrCoord[0])) {
-            int x = stoi(idOrCoord);
-            int y;
-            ss >> y;
+        if (idOrCoord == "rect") {
+            Rect area;
+            if (!parseRegion(ss, area)) {
+                *console.error << "Usage: select rect x0 y0 x1 y1" << endl;
+                return;
+            }
+            size_t count = board.selectRect(area);
+            if (count > 0) {
+                *console.output << count << " shapes selected." << endl;
+            } else {
+                *console.output << "No shape found." << endl;
+            }
+        }
+        else if (isdigit(idOrCoord[0])) {
+            int x, y;
+            if (!parseInt(idOrCoord, x) || !readInts(ss, y)) {
+                *console.output << "No shape found." << endl;
+                return;
+            }
             board.selectByCoord(x, y);
         }
         else {
@@ -801,24 +4176,43 @@ private:
     }
 
     void remove() {
+        if (board.hasRegion()) {
+            *console.info << board.removeRegion() << " shapes removed" << endl;
+            return;
+        }
         board.removeSelectedShape();
     }
 
     void edit(stringstream &ss) {
         vector<int> params;
-        int param;
-        while (ss >> param) {
+        string token;
+        while (ss >> token) {
+            int param;
+            if (!parseInt(token, param)) {
+                *console.error << "Error: Could not edit shape with given parameters." << endl;
+                return;
+            }
             params.push_back(param);
         }
 
-        auto selectedShape = board.getSelectedShape();
-        if (!selectedShape) {
-            cout << "No shape selected to edit" << endl;
+        if (board.hasRegion()) {
+            auto [edited, skipped] = board.editRegion(params);
+            if (edited == 0 && skipped > 0) {
+                *console.error << "Error: Could not edit shape with given parameters." << endl;
+            } else {
+                *console.info << edited << " shapes edited";
+                if (skipped > 0) *console.info << ", " << skipped << " skipped";
+                *console.info << endl;
+            }
+            return;
+        }
+        if (!board.hasSelection()) {
+            *console.error << "No shape selected to edit" << endl;
             return;
         }
 
-        if (!selectedShape->edit(params)) {
-            cout << "Error: Could not edit shape with given parameters." << endl;
+        if (!board.editSelected(params)) {
+            *console.error << "Error: Could not edit shape with given parameters." << endl;
         }
     }
 
@@ -826,39 +4220,775 @@ private:
         string color;
         ss >> color;
 
-        auto selectedShape = board.getSelectedShape();
-        if (!selectedShape) {
-            cout << "No shape selected to paint." << endl;
+        if (!board.hasSelection() && !board.hasRegion()) {
+            *console.error << "No shape selected to paint." << endl;
+            return;
+        }
+        if (!isColor(color)) {
+            *console.error << "Unknown color: " << color << endl;
+            return;
+        }
+        if (board.hasRegion()) {
+            *console.info << board.paintRegion(color[0]) << " shapes painted " << color << endl;
             return;
         }
 
         char colorChar = color[0];
-        selectedShape->paint(colorChar);
-        cout << selectedShape->getId() << " " << selectedShape->getDescription() << "painted" << color << endl;
+        board.paintSelected(colorChar);
+        *console.info << shapeIdName(board.getSelectedId()) << " " << board.describeSelected() << "painted" << color << endl;
     }
 
     void move(stringstream &ss) {
         int newX, newY;
-        ss >> newX >> newY;
+        if (!readInts(ss, newX, newY)) {
+            *console.error << "Usage: move x y" << endl;
+            return;
+        }
 
-        auto selectedShape = board.getSelectedShape();
-        if (!selectedShape) {
-            cout << "No shape selected to move." << endl;
+        // With a region selected the coordinates are an offset.
+        if (board.hasRegion()) {
+            if (optional<size_t> moved = board.moveRegion(newX, newY)) {
+                *console.info << *moved << " shapes moved" << endl;
+            }
+            return;
+        }
+        if (!board.hasSelection()) {
+            *console.error << "No shape selected to move." << endl;
+            return;
+        }
+
+        if (board.moveSelected(newX, newY)) {
+            *console.info << shapeIdName(board.getSelectedId()) << " " << board.describeSelected() << " moved" << endl;
+        }
+    }
+
+    void restack(Board::Restack how, const char* done, const char* unchanged) {
+        if (!board.hasSelection()) {
+            *console.error << "No shape selected to reorder." << endl;
+            return;
+        }
+        string name = shapeIdName(board.getSelectedId());
+        if (board.restackSelected(how)) {
+            *console.info << name << " " << done << endl;
+        } else {
+            *console.info << name << " is " << unchanged << endl;
+        }
+    }
+
+    void exportBoard(stringstream &ss) {
+        string filename, scaleText, samplesText;
+        ss >> filename >> scaleText >> samplesText;
+        int scale = 1, samples = 1;
+        if (filename.empty() || (!scaleText.empty() && !parseInt(scaleText, scale)) ||
+            (!samplesText.empty() && !parseInt(samplesText, samples)) || scale < 1 || samples < 1 || samples > MAX_EXPORT_SAMPLES) {
+            *console.error << "Usage: export file.ppm|file.pgm [scale] [samples 1.." << MAX_EXPORT_SAMPLES << "]" << endl;
+            return;
+        }
+        exportImage(board, filename, scale, samples);
+    }
+
+    void resize(stringstream &ss) {
+        int width, height;
+        if (!readInts(ss, width, height) || !validBoardSize(width, height)) {
+            *console.error << "Usage: resize width height (1.." << MAX_BOARD_SIDE << ")" << endl;
+            return;
+        }
+        board.resize(width, height);
+        *console.info << "Board resized to " << width << "x" << height << endl;
+    }
+
+    void threads(stringstream &ss) {
+        string token;
+        if (!(ss >> token)) {
+            *console.output << "Rendering with " << board.getRenderThreads() << " thread(s)." << endl;
+            return;
+        }
+        int count;
+        if (!parseInt(token, count) || count < 1 || count > MAX_RENDER_THREADS) {
+            *console.error << "Usage: threads count (1.." << MAX_RENDER_THREADS << ")" << endl;
+            return;
+        }
+        board.setRenderThreads(count);
+        *console.info << "Rendering with " << count << " thread(s)." << endl;
+    }
+
+    void stats(stringstream &ss) {
+        string mode;
+        ss >> mode;
+        if (mode == "reset") {
+            metrics.reset();
+            *console.info << "Statistics reset." << endl;
+        } else if (mode.empty()) {
+            board.collectFrameStats();
+            metrics.print(*console.output);
+        } else {
+            *console.error << "Usage: stats [reset]" << endl;
+        }
+    }
+
+    void cull(const string& mode) {
+        if (mode == "on" || mode == "off") {
+            board.setOcclusionCulling(mode == "on");
+        } else if (!mode.empty()) {
+            *console.error << "Usage: cull [on|off]" << endl;
             return;
         }
+        *console.info << "Occlusion culling " << (board.getOcclusionCulling() ? "on" : "off") << "." << endl;
+    }
+
+    void live(const string& mode) {
+        if (mode == "on") {
+            if (board.setLiveMode(true)) {
+                *console.info << "Live redraw enabled." << endl;
+            } else {
+                *console.error << "Terminal is too small for live redraw." << endl;
+            }
+        } else if (mode == "off") {
+            board.setLiveMode(false);
+            *console.info << "Live redraw disabled." << endl;
+        } else {
+            *console.error << "Usage: live on|off" << endl;
+        }
+    }
+};
+
+// Synthetic board shapes for the benchmark suite. Weights pick triangle, circle, rectangle, square.
+struct BenchBoardSpec {
+    const char* name;
+    int width, height;
+    int shapes;
+    int weights[4];
+    double fillRatio;
+    int maxExtent;
+};
+
+const BenchBoardSpec BENCH_BOARDS[] = {
+    {"small-mixed", 80, 25, 200, {1, 1, 1, 1}, 0.5, 10},
+    {"medium-mixed", 400, 200, 5000, {1, 1, 1, 1}, 0.5, 30},
+    {"large-outline", 2000, 1000, 50000, {1, 2, 1, 1}, 0.0, 60},
+    {"large-filled", 2000, 1000, 50000, {1, 1, 2, 2}, 1.0, 60},
+    {"huge-sparse", 4000, 2000, 200000, {1, 1, 1, 1}, 0.3, 40},
+};
+
+const int BENCH_LOOKUPS = 1000;
+
+struct BenchResult {
+    string board;
+    string name;
+    const BenchBoardSpec* spec;
+    int opsPerSample;
+    vector<double> samples;     // seconds per operation, sorted
+
+    double percentile(double p) const {
+        size_t rank = (size_t)ceil(p / 100 * samples.size());
+        return samples[min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+    }
+
+    double mean() const {
+        double sum = 0;
+        for (double sample : samples) sum += sample;
+        return sum / samples.size();
+    }
+};
+
+class Benchmark {
+private:
+    int reps;
+    int warmup;
+    int threads;
+    string filter;
+    vector<BenchResult> results;
+
+    static ShapeStore generate(const BenchBoardSpec& spec, mt19937& rng) {
+        discrete_distribution<int> kind(begin(spec.weights), end(spec.weights));
+        uniform_int_distribution<int> extent(1, spec.maxExtent);
+        uniform_int_distribution<int> px(0, spec.width - 1);
+        uniform_int_distribution<int> py(0, spec.height - 1);
+        bernoulli_distribution filled(spec.fillRatio);
+        const char colors[] = "rgby";
+
+        ShapeStore shapes;
+        shapes.reserve(spec.shapes);
+        for (int i = 0; i < spec.shapes; ++i) {
+            char color = colors[rng() % 4];
+            bool fill = filled(rng);
+            int x = px(rng), y = py(rng), a = extent(rng), b = extent(rng);
+            switch (kind(rng)) {
+                case 0: shapes.insert(i + 1, Triangle(color, fill, x, y, a), i); break;
+                case 1: shapes.insert(i + 1, Circle(color, fill, x, y, a / 2 + 1), i); break;
+                case 2: shapes.insert(i + 1, Rectangle(color, fill, x, y, a, b), i); break;
+                default: shapes.insert(i + 1, Square(color, fill, x, y, a), i); break;
+            }
+        }
+        return shapes;
+    }
+
+    void measure(const BenchBoardSpec& spec, const string& name, int opsPerSample, const function<void()>& op) {
+        for (int i = 0; i < warmup; ++i) {
+            op();
+        }
+        BenchResult result{spec.name, name, &spec, opsPerSample, {}};
+        for (int i = 0; i < reps; ++i) {
+            auto start = chrono::steady_clock::now();
+            op();
+            result.samples.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count() / opsPerSample);
+        }
+        sort(result.samples.begin(), result.samples.end());
+        cout << left << setw(16) << result.board << setw(14) << name << right << fixed << setprecision(2)
+             << setw(14) << result.percentile(50) * 1e6 << setw(14) << result.percentile(90) * 1e6
+             << setw(14) << result.percentile(99) * 1e6 << endl;
+        results.push_back(move(result));
+    }
+
+    void runBoard(const BenchBoardSpec& spec, const string& scratch) {
+        mt19937 rng(12345);
+        Board board(spec.width, spec.height);
+        board.setRenderThreads(threads);
+        int devNull = open("/dev/null", O_WRONLY);
+        board.setFrameOutput(devNull);
+        board.replaceShapes(generate(spec, rng));
+
+        measure(spec, "draw", 1, [&]() {
+            board.invalidate();
+            board.drawBoard();
+        });
+
+        Canvas canvas(spec.width, spec.height);
+        measure(spec, "raster", 1, [&]() {
+            canvas.fill(canvas.bounds(), BLANK_CELL);
+            board.forEachShape([&](int, const ShapeData& shape) {
+                visit([&](const auto& s) { s.draw(canvas, canvas.bounds()); }, shape);
+            });
+        });
+
+        vector<pair<int, int>> points(BENCH_LOOKUPS);
+        vector<string> names(BENCH_LOOKUPS);
+        for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+            points[i] = {int(rng() % spec.width), int(rng() % spec.height)};
+            names[i] = shapeIdName(rng() % spec.shapes + 1);
+        }
+        measure(spec, "select-coord", BENCH_LOOKUPS, [&]() {
+            for (const auto& [x, y] : points) board.selectByCoord(x, y);
+        });
+        measure(spec, "select-id", BENCH_LOOKUPS, [&]() {
+            for (const string& name : names) board.selectById(name);
+        });
+
+        board.selectRect({0, 0, spec.width / 4, spec.height / 4});
+        int paints = 0;
+        measure(spec, "paint-region", 1, [&]() {
+            board.paintRegion(paints++ % 2 ? 'r' : 'g');
+            board.drawBoard();
+        });
+
+        string text = scratch + ".txt";
+        string binary = scratch + ".bin";
+        measure(spec, "save-text", 1, [&]() { saveText(board, text); });
+        measure(spec, "load-text", 1, [&]() { loadText(board, text); });
+        measure(spec, "save-binary", 1, [&]() { saveBinary(board, binary); });
+        measure(spec, "load-binary", 1, [&]() { loadBinary(board, binary); });
+        unlink(text.c_str());
+        unlink(binary.c_str());
+        close(devNull);
+    }
+
+public:
+    Benchmark(int reps, int warmup, int threads, const string& filter)
+        : reps(reps), warmup(warmup), threads(threads), filter(filter) {}
+
+    void run() {
+        const char* tmp = getenv("TMPDIR");
+        string scratch = string(tmp ? tmp : "/tmp") + "/blackboard-bench-" + to_string(getpid());
+
+        cout << left << setw(16) << "board" << setw(14) << "case" << right
+             << setw(14) << "p50 us/op" << setw(14) << "p90 us/op" << setw(14) << "p99 us/op" << endl;
+        for (const BenchBoardSpec& spec : BENCH_BOARDS) {
+            if (string(spec.name).find(filter) != string::npos) {
+                runBoard(spec, scratch);
+            }
+        }
+    }
+
+    bool writeJson(const string& filename) const {
+        ofstream out(filename);
+        if (!out.is_open()) return false;
+        out << fixed << setprecision(3);
+        out << "{\n  \"threads\": " << threads << ",\n  \"reps\": " << reps << ",\n  \"warmup\": " << warmup
+            << ",\n  \"unit\": \"us/op\",\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            out << (i ? "," : "") << "\n    {\"board\": \"" << r.board << "\", \"case\": \"" << r.name
+                << "\", \"width\": " << r.spec->width << ", \"height\": " << r.spec->height
+                << ", \"shapes\": " << r.spec->shapes << ", \"fill_ratio\": " << r.spec->fillRatio
+                << ", \"ops_per_sample\": " << r.opsPerSample
+                << ", \"min\": " << r.samples.front() * 1e6 << ", \"mean\": " << r.mean() * 1e6
+                << ", \"p50\": " << r.percentile(50) * 1e6 << ", \"p90\": " << r.percentile(90) * 1e6
+                << ", \"p99\": " << r.percentile(99) * 1e6 << ", \"max\": " << r.samples.back() * 1e6 << "}";
+        }
+        out << "\n  ]\n}\n";
+        return out.good();
+    }
+};
+
+const int SERVER_BACKLOG = 64;
+const size_t CLIENT_READ_SIZE = 64 << 10;
+const int SERVER_POLL_MS = 200;
+const int SERVER_ACCEPT_BACKOFF_MS = 10;
+
+volatile sig_atomic_t serverStopRequested = 0;
+
+// Serves the command language to many clients over a Unix domain socket. Editing commands run
+// one at a time against the shared board; list, draw and select read an immutable snapshot
+// published RCU-style, so queries never queue behind the editing client. Edits never build
+// snapshots: the first query that needs a newer version than the published one does.
+class BoardServer {
+private:
+    struct Client {
+        int id;
+        int fd;
+        int selectedId = 0;
+        vector<int> region;
+        uint64_t writtenVersion = 0;
+        uint64_t started = nowNs();
+        atomic<uint64_t> commands{0};
+        atomic<uint64_t> reads{0};
+        atomic<uint64_t> writes{0};
+        atomic<uint64_t> bytesSent{0};
+        atomic<bool> done{false};
+        map<string, LatencyHistogram> latency;
+        FrameComposer composer;
+        ostringstream text;
+        thread worker;
+
+        Client(int id, int fd) : id(id), fd(fd) {
+            composer.setOutput(fd);
+            composer.setConsoleFlush(false);
+        }
+    };
+
+    UserInterface& ui;
+    mutex writeLock;
+    // Moved only by commands that change the board, so settings and reports keep the snapshot.
+    atomic<uint64_t> version{1};
+    shared_ptr<const BoardSnapshot> published;
+    mutex clientsLock;
+    list<unique_ptr<Client>> clients;
+    int nextClientId = 1;
+
+    // A stale snapshot is rebuilt only if no edit is running, unless it predates this client's
+    // own writes: every client reads its own edits, and nobody waits for anyone else's.
+    shared_ptr<const BoardSnapshot> snapshotFor(Client& client) {
+        shared_ptr<const BoardSnapshot> snapshot = atomic_load(&published);
+        if (snapshot && snapshot->version == version) return snapshot;
+
+        unique_lock<mutex> guard(writeLock, defer_lock);
+        if (snapshot && snapshot->version >= client.writtenVersion) {
+            if (!guard.try_lock()) return snapshot;
+        } else {
+            guard.lock();
+        }
+        snapshot = atomic_load(&published);
+        if (!snapshot || snapshot->version != version) {
+            snapshot = ui.getBoard().snapshot(version);
+            atomic_store(&published, snapshot);
+        }
+        return snapshot;
+    }
+
+    void query(Client& client, const string& cmd, stringstream& ss) {
+        shared_ptr<const BoardSnapshot> snapshot = snapshotFor(client);
+        const ShapeStore& store = snapshot->store;
+        if (cmd == "list") {
+            client.text << "List of shapes:" << endl;
+            snapshot->zorder.forEachInOrder([&](uint32_t slot) {
+                client.text << describeShape(store.idAt(slot), store.at(slot)) << endl;
+            });
+        } else if (cmd == "draw") {
+            send(client);
+            client.composer.compose(snapshot->canvas);
+            client.bytesSent += client.composer.getLastFrameBytes();
+            client.text << "Frame: " << client.composer.getLastFrameBytes() << " bytes" << endl;
+        } else {
+            string idOrCoord;
+            ss >> idOrCoord;
+            uint32_t slot = NO_SLOT;
+            int id;
+            Rect area;
+            if (idOrCoord == "rect") {
+                if (!parseRegion(ss, area)) {
+                    client.text << "Usage: select rect x0 y0 x1 y1" << endl;
+                    return;
+                }
+                client.selectedId = 0;
+                client.region.clear();
+                for (uint32_t found : snapshot->index.overlapping(area, store)) {
+                    client.region.push_back(store.idAt(found));
+                }
+                if (client.region.empty()) {
+                    client.text << "No shape found." << endl;
+                } else {
+                    client.text << client.region.size() << " shapes selected." << endl;
+                }
+                return;
+            } else if (isdigit(idOrCoord[0])) {
+                int x, y;
+                if (parseInt(idOrCoord, x) && readInts(ss, y)) {
+                    slot = snapshot->index.topmostAt(x, y, store);
+                }
+                if (slot == NO_SLOT) {
+                    client.text << "No shape found." << endl;
+                    return;
+                }
+            } else if (parseShapeId(idOrCoord, id)) {
+                slot = store.find(id);
+            }
+            if (slot == NO_SLOT) {
+                client.text << "Shape not found." << endl;
+                return;
+            }
+            client.selectedId = store.idAt(slot);
+            client.region.clear();
+            client.text << "Shape selected: " << describeShape(client.selectedId, store.at(slot)) << endl;
+        }
+    }
+
+    // The reply waits for the change log outside the lock, so concurrent writers share a sync.
+    void edit(Client& client, string& cmd, stringstream& ss) {
+        Board& board = ui.getBoard();
+        bool mutating = UserInterface::mutates(cmd) && !board.readOnly();
+        {
+            lock_guard<mutex> guard(writeLock);
+            Console saved = console;
+            console.output = console.info = console.error = &client.text;
+            board.setSelectedId(client.selectedId);
+            board.swapRegion(client.region);
+            ui.execute(cmd, ss);
+            client.selectedId = board.getSelectedId();
+            board.swapRegion(client.region);
+            console = saved;
+            if (mutating) {
+                client.writtenVersion = ++version;
+            }
+        }
+        if (mutating && !board.awaitDurable()) {
+            client.text << UNSAVED_CHANGE_ERROR << endl;
+        }
+    }
+
+    // Runs one line; returns false when the client is done.
+    bool handle(Client& client, const string& line) {
+        stringstream ss(line);
+        string cmd;
+        if (!(ss >> cmd) || cmd[0] == '#') return true;
+        if (cmd == "exit") return false;
+
+        uint64_t start = nowNs();
+        if (cmd == "list" || cmd == "draw" || cmd == "select") {
+            query(client, cmd, ss);
+            client.reads++;
+        } else if (cmd == "clients") {
+            report(client.text);
+            client.reads++;
+        } else if (cmd == "live") {
+            client.text << "Live redraw is not available over the server." << endl;
+        } else {
+            edit(client, cmd, ss);
+            client.writes++;
+        }
+        client.commands++;
+        client.latency[cmd].add(nowNs() - start);
+        return true;
+    }
+
+    void send(Client& client) {
+        string out = client.text.str();
+        client.text.str("");
+        const char* data = out.data();
+        size_t remaining = out.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(client.fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            data += written;
+            remaining -= written;
+            client.bytesSent += written;
+        }
+    }
+
+    // Output is sent once per read from the socket, so pipelined commands share writes.
+    void serve(Client& client) {
+        vector<char> buffer(CLIENT_READ_SIZE);
+        string input;
+        bool open = true;
+        while (open) {
+            ssize_t got = ::read(client.fd, buffer.data(), buffer.size());
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            input.append(buffer.data(), got);
+
+            size_t start = 0;
+            for (size_t end; open && (end = input.find('\n', start)) != string::npos; start = end + 1) {
+                size_t length = end - start;
+                if (length > 0 && input[end - 1] == '\r') length--;
+                open = handle(client, input.substr(start, length));
+            }
+            input.erase(0, start);
+            send(client);
+        }
+
+        {
+            lock_guard<mutex> guard(writeLock);
+            for (const auto& [name, histogram] : client.latency) {
+                metrics.commands[name].merge(histogram);
+            }
+            client.composer.getTally().drainInto(metrics);
+        }
+        {
+            lock_guard<mutex> guard(clientsLock);
+            cerr << describe(client) << ", disconnected" << endl;
+        }
+        shutdown(client.fd, SHUT_RDWR);
+        client.done = true;
+    }
+
+    static string describe(const Client& client) {
+        double seconds = (nowNs() - client.started) / 1e9;
+        ostringstream line;
+        line << "Client " << client.id << ": " << client.commands << " commands (" << client.reads << " reads, "
+             << client.writes << " writes) in " << fixed << setprecision(3) << seconds << " s, "
+             << setprecision(0) << (seconds > 0 ? client.commands / seconds : 0.0) << " commands/s, "
+             << client.bytesSent << " bytes sent";
+        return line.str();
+    }
+
+    void report(ostream& out) {
+        lock_guard<mutex> guard(clientsLock);
+        for (const auto& client : clients) {
+            if (!client->done) {
+                out << describe(*client) << endl;
+            }
+        }
+    }
+
+    // Joins finished clients, or all of them once the server stops. Joining happens outside
+    // the lock because a closing client logs under it.
+    void reap(bool all) {
+        list<unique_ptr<Client>> finished;
+        {
+            lock_guard<mutex> guard(clientsLock);
+            for (auto it = clients.begin(); it != clients.end();) {
+                auto following = next(it);
+                if (all || (*it)->done) {
+                    if (!(*it)->done) shutdown((*it)->fd, SHUT_RDWR);
+                    finished.splice(finished.end(), clients, it);
+                }
+                it = following;
+            }
+        }
+        for (auto& client : finished) {
+            client->worker.join();
+            close(client->fd);
+        }
+    }
+
+public:
+    explicit BoardServer(UserInterface& ui) : ui(ui) {}
+
+    // Serves until SIGINT or SIGTERM; returns false if the socket cannot be opened.
+    bool run(const string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            cerr << "Socket path too long: " << path << endl;
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        struct stat existing;
+        if (stat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+            unlink(path.c_str());
+        }
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+            listen(listener, SERVER_BACKLOG) != 0) {
+            cerr << "Cannot listen on " << path << ": " << strerror(errno) << endl;
+            if (listener >= 0) close(listener);
+            return false;
+        }
 
-        if (selectedShape->move(newX, newY)) {
-            auto& shapes = board.getShapes();
-            shapes.erase(std::remove(shapes.begin(), shapes.end(), selectedShape), shapes.end());
-            shapes.push_back(selectedShape);
-            cout << selectedShape->getId() << " " << selectedShape->getDescription() << " moved" << endl;
+        signal(SIGPIPE, SIG_IGN);
+        struct sigaction stop{};
+        stop.sa_handler = [](int) { serverStopRequested = 1; };
+        sigaction(SIGINT, &stop, nullptr);
+        sigaction(SIGTERM, &stop, nullptr);
+        cerr << "Serving on " << path << endl;
+
+        // Held in reserve for running out of descriptors: closing it frees one to accept and
+        // hang up on the waiting connection, so the listener does not stay readable forever.
+        int spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        while (!serverStopRequested) {
+            reap(false);
+            if (spare < 0) spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            pollfd wait{listener, POLLIN, 0};
+            if (poll(&wait, 1, SERVER_POLL_MS) <= 0) continue;
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    reap(false);
+                    if (spare >= 0) {
+                        close(spare);
+                        int refused = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+                        if (refused >= 0) close(refused);
+                        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    }
+                    {
+                        lock_guard<mutex> guard(clientsLock);
+                        cerr << "Out of file descriptors, refused a client" << endl;
+                    }
+                    this_thread::sleep_for(chrono::milliseconds(SERVER_ACCEPT_BACKOFF_MS));
+                }
+                continue;
+            }
+            lock_guard<mutex> guard(clientsLock);
+            clients.push_back(make_unique<Client>(nextClientId++, fd));
+            Client& client = *clients.back();
+            client.worker = thread([this, &client]() { serve(client); });
         }
+
+        if (spare >= 0) close(spare);
+        close(listener);
+        unlink(path.c_str());
+        reap(true);
+        return true;
     }
 };
 
-int main() {
-    UserInterface ui;
-    ui.run();
+int main(int argc, char* argv[]) {
+    int width = DEFAULT_BOARD_WIDTH;
+    int height = DEFAULT_BOARD_HEIGHT;
+    int threads = 1;
+    const char* batchFile = nullptr;
+    bool bench = false;
+    string benchOut, benchFilter;
+    const char* statsFile = nullptr;
+    const char* socketPath = nullptr;
+    const char* logDirectory = nullptr;
+    int benchReps = 15, benchWarmup = 3;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc) {
+            if (!parseBoardSize(argv[++i], width, height)) {
+                cerr << "Invalid board size, expected WIDTHxHEIGHT with sides up to " << MAX_BOARD_SIDE << endl;
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1 || threads > MAX_RENDER_THREADS) {
+                cerr << "Invalid thread count, expected 1.." << MAX_RENDER_THREADS << endl;
+                return 1;
+            }
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchFile = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--wal" && i + 1 < argc) {
+            logDirectory = argv[++i];
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            statsFile = argv[++i];
+        } else if (arg == "--bench") {
+            bench = true;
+        } else if (arg == "--bench-out" && i + 1 < argc) {
+            benchOut = argv[++i];
+        } else if (arg == "--bench-filter" && i + 1 < argc) {
+            benchFilter = argv[++i];
+        } else if (arg == "--bench-reps" && i + 1 < argc) {
+            benchReps = atoi(argv[++i]);
+        } else if (arg == "--bench-warmup" && i + 1 < argc) {
+            benchWarmup = atoi(argv[++i]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--size WIDTHxHEIGHT] [--threads N] [--batch FILE|-] [--serve SOCKET] [--wal DIR] [--stats-json FILE]\n"
+                 << "       " << argv[0] << " --bench [--bench-out FILE.json] [--bench-filter NAME] [--bench-reps N] [--bench-warmup N] [--threads N]" << endl;
+            return 1;
+        }
+    }
+
+    if (bench) {
+        if (benchReps < 1 || benchWarmup < 0) {
+            cerr << "Invalid benchmark repetitions" << endl;
+            return 1;
+        }
+        ostream discard(nullptr);
+        console.output = console.info = &discard;
+        console.error = &cerr;
+        Benchmark suite(benchReps, benchWarmup, threads, benchFilter);
+        suite.run();
+        if (!benchOut.empty() && !suite.writeJson(benchOut)) {
+            cerr << "Cannot write " << benchOut << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    unique_ptr<WriteAheadLog> changeLog;
+    ShapeStore recovered;
+    if (logDirectory) {
+        changeLog = make_unique<WriteAheadLog>(logDirectory);
+        long long replayed = changeLog->recover(recovered, width, height);
+        if (replayed < 0) {
+            return 1;
+        }
+        cerr << "Recovered " << recovered.size() << " shapes from " << logDirectory << " (" << replayed
+             << " log records replayed)" << endl;
+    }
+
+    UserInterface ui(width, height, threads);
+    if (changeLog) {
+        ui.getBoard().restoreShapes(move(recovered));
+        ui.getBoard().setChangeLog(changeLog.get());
+    }
+    ostream discard(nullptr);
+    if (socketPath) {
+        console.output = console.info = &discard;
+        console.error = &cerr;
+        BoardServer server(ui);
+        if (!server.run(socketPath)) {
+            return 1;
+        }
+    } else if (!batchFile) {
+        ui.run(cin);
+    } else {
+        // Batch mode: no menu, prompts or confirmations; query answers go to stdout and frames
+        // are only written on `draw`.
+        ios::sync_with_stdio(false);
+        ifstream script;
+        if (strcmp(batchFile, "-") != 0) {
+            script.open(batchFile);
+            if (!script.is_open()) {
+                cerr << "Cannot open batch file " << batchFile << endl;
+                return 1;
+            }
+        }
+        console.info = &discard;
+        console.error = &cerr;
+
+        auto start = chrono::steady_clock::now();
+        size_t executed = ui.run(script.is_open() ? script : cin);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << "Processed " << executed << " commands in " << fixed << setprecision(3) << seconds << " s ("
+             << setprecision(0) << (seconds > 0 ? executed / seconds : 0.0) << " commands/s)" << endl;
+    }
+
+    if (statsFile) {
+        ofstream out(statsFile);
+        metrics.writeJson(out);
+        if (!out.good()) {
+            cerr << "Cannot write " << statsFile << endl;
+            return 1;
+        }
+    }
     return 0;
 }
 
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Compares the board's frames against a cell-by-cell reference rasterizer.
+
+The reference follows the original per-cell drawing rules, so any span, stamp, culling or
+threading change in the renderer that alters a single cell shows up here. Each board is a
+random script of adds and restacks, including shapes that reach far past the board.
+
+Every --big-every'th board has at least BIG_BOARD_CELLS cells, which is past the renderer's
+parallel threshold, and draws with 2 to 8 threads; its whole output must also be identical to
+the same script run with one thread.
+
+    python3 tools/raster_check.py ./blackboard [--boards N] [--seed S] [--big-every N]
+"""
+
+import argparse
+import random
+import re
+import subprocess
+import sys
+
+COLORS = "rgbymcw"
+BIG_BOARD_CELLS = 1 << 16   # PARALLEL_MIN_CELLS in main.cpp
+ESCAPE = re.compile(r"\x1b\[[0-9;]*[A-Za-z]")
+
+
+def circle_outline(r, keep):
+    """Midpoint outline offsets; only those `keep` accepts are stored, so huge radii stay cheap."""
+    points = set()
+    x, y, decision = r, 0, 1 - r
+    while x >= y:
+        for dx, dy in ((x, y), (y, x)):
+            for sx in (1, -1):
+                for sy in (1, -1):
+                    if keep(sx * dx, sy * dy):
+                        points.add((sx * dx, sy * dy))
+        y += 1
+        if decision <= 0:
+            decision += 2 * y + 1
+        else:
+            x -= 1
+            decision += 2 * (y - x) + 1
+    return points
+
+
+def covers(shape, cx, cy, outline):
+    kind, fill, x, y, a, b = shape
+    if kind in ("rectangle", "square"):
+        w, h = (a, b) if kind == "rectangle" else (a, a)
+        if not (x <= cx < x + w and y <= cy < y + h):
+            return False
+        return fill or cx in (x, x + w - 1) or cy in (y, y + h - 1)
+    if kind == "triangle":
+        row = cy - y
+        if not 0 <= row < a:
+            return False
+        dx = abs(cx - x)
+        return dx <= row and (fill or dx == row or row == a - 1)
+    dx, dy = cx - x, cy - y
+    return (cx - x, cy - y) in outline or (fill and dx * dx + dy * dy <= a * a)
+
+
+def reference(width, height, shapes):
+    grid = [[" "] * width for _ in range(height)]
+    for shape, color in shapes:
+        kind, fill, x, y, a, b = shape
+        on_board = lambda dx, dy: 0 <= x + dx < width and 0 <= y + dy < height
+        outline = circle_outline(a, on_board) if kind == "circle" and a >= 0 else set()
+        if kind == "circle":
+            x0, y0, x1, y1 = x - a, y - a, x + a + 1, y + a + 1
+        elif kind == "triangle":
+            x0, y0, x1, y1 = x - a + 1, y, x + a, y + a
+        else:
+            x0, y0, x1, y1 = x, y, x + a, y + (b if kind == "rectangle" else a)
+        for cy in range(max(0, y0), min(height, y1)):
+            for cx in range(max(0, x0), min(width, x1)):
+                if covers(shape, cx, cy, outline):
+                    grid[cy][cx] = color
+    return ["".join(row) for row in grid]
+
+
+def random_shape(rng, width, height, huge):
+    kind = rng.choice(["rectangle", "square", "triangle", "circle"])
+    fill = rng.random() < 0.5
+    x, y = rng.randint(-10, width + 10), rng.randint(-10, height + 10)
+    a, b = rng.randint(1, max(width, height) // 2), rng.randint(1, height)
+    if huge:
+        # Far past the board in one direction. Circle radii go past 46341, where r * r no
+        # longer fits an int, and the edge is placed to cross the board.
+        if kind == "circle":
+            a = rng.randint(46341, 1000000)
+            edge = rng.randint(-5, width + 5)
+            x = rng.choice([edge - a, edge + a])
+            y = rng.randint(-5, height + 5)
+        elif kind == "rectangle":
+            x, y = rng.randint(0, width - 1), rng.randint(-5, height)
+            a, b = rng.randint(1, 12), 300000000
+        else:
+            a = rng.randint(10 * width, 200000000)
+    return (kind, fill, x, y, a, b)
+
+
+def command(shape, color):
+    kind, fill, x, y, a, b = shape
+    args = [x, y, a, b] if kind == "rectangle" else [x, y, a]
+    return " ".join(["add", "fill" if fill else "frame", color, kind] + [str(v) for v in args])
+
+
+def run_script(binary, lines, index):
+    result = subprocess.run([binary, "--batch", "-"], input="\n".join(lines) + "\n",
+                            capture_output=True, text=True)
+    if result.returncode != 0:
+        print("board %d: exit code %d\n%s" % (index, result.returncode, result.stderr))
+        return None
+    return result.stdout
+
+
+def run_board(binary, rng, index, big):
+    if big:
+        width = rng.randint(330, 500)
+        height = rng.randint(-(-BIG_BOARD_CELLS // width), 260)
+        threads = rng.choice([2, 4, 8])
+    else:
+        width, height = rng.randint(20, 120), rng.randint(10, 60)
+        threads = rng.choice([1, 2, 4])
+    lines = ["resize %d %d" % (width, height), "threads %d" % threads,
+             "cull " + rng.choice(["on", "off"])]
+    shapes = []
+    for _ in range(rng.randint(1, 60)):
+        shape = random_shape(rng, width, height, rng.random() < 0.05)
+        color = rng.choice(COLORS)
+        shapes.append((shape, color))
+        lines.append(command(shape, color))
+        if rng.random() < 0.1:
+            lines.append("draw")
+    for _ in range(rng.randint(0, 10)):
+        i = rng.randrange(len(shapes))
+        how = rng.choice(["front", "back"])
+        lines += ["select Shape%d" % (i + 1), how]
+    lines.append("draw")
+
+    order = list(range(len(shapes)))
+    for line in lines:
+        if line.startswith("select"):
+            chosen = int(line.split()[1][5:]) - 1
+        elif line in ("front", "back"):
+            order.remove(chosen)
+            order.insert(len(order) if line == "front" else 0, chosen)
+    expected = reference(width, height, [shapes[i] for i in order])
+
+    output = run_script(binary, lines, index)
+    if output is None:
+        return False
+    if big:
+        serial = run_script(binary, lines[:1] + ["threads 1"] + lines[2:], index)
+        if serial != output:
+            print("board %d: %d threads draw differently from one\nscript:\n%s" % (index, threads, "\n".join(lines)))
+            return False
+    rows = [ESCAPE.sub("", row) for row in output.splitlines() if row.startswith("|")]
+    actual = [row[1:-1] for row in rows[-height:]]
+    if actual != expected:
+        print("board %d: frame differs from the reference" % index)
+        for y, (got, want) in enumerate(zip(actual, expected)):
+            if got != want:
+                print("  row %d\n    got  %r\n    want %r" % (y, got, want))
+        print("script:\n" + "\n".join(lines))
+        return False
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("binary")
+    parser.add_argument("--boards", type=int, default=200)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--big-every", type=int, default=5)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    failed = sum(not run_board(args.binary, rng, i, i % args.big_every == args.big_every - 1) for i in range(args.boards))
+    print("%d of %d boards match" % (args.boards - failed, args.boards))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+"""Checks that the board server survives hostile clients.
+
+Each check starts `binary --serve` on a temporary socket:
+
+  - out-of-range numbers: commands whose numbers overflow or are malformed must be answered
+    on the same connection, and a new client must still see the board;
+  - churn: thousands of short-lived clients must not leave their descriptors open;
+  - descriptor exhaustion: with a low descriptor limit, more idle clients than the server can
+    hold must not wedge it, and it must serve again once they leave.
+
+    python3 tools/server_check.py ./blackboard
+"""
+
+import argparse
+import os
+import resource
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+BAD_LINES = [
+    "select 99999999999 1",
+    "select 1 99999999999",
+    "select 1",
+    "select rect 0 0 99999999999 1",
+    "select rect 0 0 1",
+    "add fill r circle 1 1 99999999999",
+    "add fill r rectangle 1 1 -99999999999 2",
+    "add fill r square 1 1 abc",
+    "move 99999999999 0",
+    "edit 99999999999",
+    "threads 99999999999",
+    "resize 99999999999 10",
+    "undo 99999999999999999999999",
+]
+
+CHURN_CLIENTS = 2000
+LOW_FD_LIMIT = 64
+IDLE_CLIENTS = 100
+
+
+def connect(path, timeout=5.0):
+    deadline = time.time() + timeout
+    while True:
+        client = socket.socket(socket.AF_UNIX)
+        client.settimeout(timeout)
+        try:
+            client.connect(path)
+            return client
+        except OSError:
+            client.close()
+            if time.time() > deadline:
+                raise
+            time.sleep(0.05)
+
+
+def converse(path, lines):
+    client = connect(path)
+    client.sendall(("\n".join(lines) + "\n").encode())
+    client.shutdown(socket.SHUT_WR)
+    reply = b""
+    while True:
+        chunk = client.recv(65536)
+        if not chunk:
+            break
+        reply += chunk
+    client.close()
+    return reply.decode("latin1")
+
+
+def open_descriptors(pid):
+    return len(os.listdir("/proc/%d/fd" % pid))
+
+
+def check_bad_numbers(path, server):
+    reply = converse(path, BAD_LINES + ["add fill r circle 5 5 2", "select 5 5", "list"])
+    if "Shape selected:" not in reply or "List of shapes:" not in reply:
+        print("connection stopped answering after out-of-range numbers:\n" + reply)
+        return False
+    reply = converse(path, ["list"])
+    if "circle red fill 5 5 2" not in reply:
+        print("a new client does not see the board:\n" + reply)
+        return False
+    return True
+
+
+def check_churn(path, server):
+    before = open_descriptors(server.pid)
+    for i in range(CHURN_CLIENTS):
+        converse(path, ["select %d %d" % (i % 50, i % 20)])
+    # Measured right away, without giving the server an idle moment to clean up.
+    after = open_descriptors(server.pid)
+    if after > before + 16:
+        print("%d descriptors open after %d clients, %d before" % (after, CHURN_CLIENTS, before))
+        return False
+    return True
+
+
+def check_exhaustion(path, server):
+    idle = []
+    for _ in range(IDLE_CLIENTS):
+        try:
+            idle.append(connect(path, timeout=1.0))
+        except OSError:
+            break
+    time.sleep(0.5)
+    for client in idle:
+        client.close()
+    time.sleep(0.5)
+    try:
+        reply = converse(path, ["add fill r circle 5 5 2", "list"])
+    except OSError as error:
+        print("server does not answer after running out of descriptors: %s" % error)
+        return False
+    if "List of shapes:" not in reply:
+        print("unexpected reply after running out of descriptors:\n" + reply)
+        return False
+    return True
+
+
+def limit_descriptors():
+    resource.setrlimit(resource.RLIMIT_NOFILE, (LOW_FD_LIMIT, LOW_FD_LIMIT))
+
+
+def run_check(binary, name, check, setup=None):
+    directory = tempfile.mkdtemp()
+    path = os.path.join(directory, "board.sock")
+    log = tempfile.TemporaryFile()
+    server = subprocess.Popen([binary, "--serve", path], stdout=subprocess.DEVNULL, stderr=log, preexec_fn=setup)
+    try:
+        connect(path).close()
+        ok = check(path, server) and server.poll() is None
+        if server.poll() is not None:
+            log.seek(0)
+            print("server exited with code %d\n%s" % (server.returncode, log.read().decode("latin1")[-2000:]))
+    finally:
+        if server.poll() is None:
+            server.terminate()
+            try:
+                server.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                print("server ignored SIGTERM")
+                server.kill()
+                server.wait()
+                ok = False
+        if os.path.exists(path):
+            os.unlink(path)
+        os.rmdir(directory)
+    print("%s: %s" % (name, "ok" if ok else "FAILED"))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("binary")
+    args = parser.parse_args()
+
+    checks = [
+        ("out-of-range numbers", check_bad_numbers, None),
+        ("churn", check_churn, None),
+        ("descriptor exhaustion", check_exhaustion, limit_descriptors),
+    ]
+    failed = sum(not run_check(args.binary, name, check, setup) for name, check, setup in checks)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())